@@ -42,6 +42,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* The vector kernels of the tinting brush; see tint_row_scalar(). */
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define TINT_SIMD
+#include <immintrin.h>
+#endif
 
 #include "xsupport/xsupport.h"
 
@@ -82,19 +94,30 @@ int brush_selection = OP;
 int visualized_brush = OP;
 int brush_component = HUE + SAT + VAL;
 
-unsigned long DARK_CURSOR = 0;
-unsigned long BRIGHT_CURSOR = 0xf3ff;
+CanvasPixel DARK_CURSOR = 0;
+CanvasPixel BRIGHT_CURSOR = 0xf3ff;
 
 static void adjust_hsv();
 static void adjust_rgb();
 
-static void apply_brush( int X, int Y );
+static void apply_stroke( int X, int Y );
+static void end_stroke();
+static void update_brush_mask();
+static void update_cursor_outline();
+static void invalidate_canvas_stats();
 static void brush_visualization();
 static void display_brush();
 
 static void reset_canvas();
 static void fill_canvas0();
+static void undo_stroke();
+static void redo_stroke();
+static void clear_history();
+static void begin_history_record();
+static void save_history_tiles( int X0, int Y0, int X1, int Y1 );
+static void end_history_record();
 static void move_cursor( int, int, unsigned int );
+extern Canvas Canvases[];
 
 /* PUSHBUTTONS. */
 static
@@ -108,6 +131,8 @@ PushButton PushButtons[] = {
   { NULL, "Quit", &QuitButton },
   { NULL, "Reset", &reset_canvas },
   { NULL, "Fill", &fill_canvas0 },
+  { NULL, "Undo", &undo_stroke },
+  { NULL, "Redo", &redo_stroke },
   { NULL, NULL, NULL }
 };
 
@@ -122,7 +147,9 @@ float Hcomponent = 120;
 float Scomponent = 1.0;
 float Vcomponent = 0.5;
 
-/* Geometry of the brush */
+/* Geometry of the brush.  Neither side of the brush exceeds MAX_BRUSH_SIZE. */
+
+#define MAX_BRUSH_SIZE 400
 
 int brush_width  = 16;
 int brush_height = 16;
@@ -132,16 +159,21 @@ float aspect_ratio = 1.0;
 
 float brush_thickness = 0.2;
 
+/* Distance between two consecutive dabs of a stroke, in percent of the brush
+   size. */
+
+int dab_spacing = 25;
+
 /* Magnification factor of the brush for visualization purposes. */
 int brush_magnif = 4;
 
-unsigned long visual_canvas_color = 0xd0ebeb;
+CanvasPixel visual_canvas_color = 0xd0ebeb;
 
 /* A buffer which contains a tinted image of a brush on the visualization
    canvas. The pixels from this buffer are used to draw a scaled visualization
    of the brush on the visualization canvas. */
 
-unsigned long brush_pixels[400][400];
+CanvasPixel brush_pixels[MAX_BRUSH_SIZE][MAX_BRUSH_SIZE];
 
 /* Functions that handle the sliders. */
 
@@ -193,11 +225,23 @@ slider_update_val( float NewValue )
   display_brush();
 }
 
+/* Keep both sides of the brush within 1 .. MAX_BRUSH_SIZE, which the aspect
+   ratio may push the side derived from the size out of. */
+
+static void
+clamp_brush_size()
+{
+  brush_width = MIN( MAX( brush_width, 1 ), MAX_BRUSH_SIZE );
+  brush_height = MIN( MAX( brush_height, 1 ), MAX_BRUSH_SIZE );
+}
+
 static void
 slider_update_brush_size( float NewValue )
 {
   brush_width = NewValue;
   brush_height = brush_width / aspect_ratio;
+  clamp_brush_size();
+  update_brush_mask();
   display_brush();
 }
 
@@ -221,6 +265,8 @@ slider_update_aspect_ratio( float NewValue )
   {
     brush_height = brush_height / aspect_ratio;
   }
+  clamp_brush_size();
+  update_brush_mask();
   display_brush();
 }
 
@@ -235,41 +281,65 @@ static void
 slider_brush_thickness( float NewValue )
 {
   brush_thickness = NewValue;
+  update_brush_mask();
   display_brush();
 }
 
+static void
+slider_dab_spacing( float NewValue )
+{
+  dab_spacing = NewValue;
+}
+
 Slider Sliders[] =
 {
-  { NULL, "Red",   0, 0xff, 0x0, 0, &SliderRChanged },
-  { NULL, "Green", 0, 0xff, 0x80, 0, &SliderGChanged },
-  { NULL, "Blue",  0, 0xff, 0x0, 0, &SliderBChanged },
+  { NULL, "Red",   0, 0xff, 0x0, 0, &SliderRChanged, true },
+  { NULL, "Green", 0, 0xff, 0x80, 0, &SliderGChanged, true },
+  { NULL, "Blue",  0, 0xff, 0x0, 0, &SliderBChanged, true },
 
-  { NULL, "Hue",        0, 360, 120, 0, &slider_update_hue },
-  { NULL, "Saturation", 0, 100, 100, 2, &slider_update_sat },
-  { NULL, "Value",      0, 100,  50, 2, &slider_update_val },
+  { NULL, "Hue",        0, 360, 120, 0, &slider_update_hue, true },
+  { NULL, "Saturation", 0, 100, 100, 2, &slider_update_sat, true },
+  { NULL, "Value",      0, 100,  50, 2, &slider_update_val, true },
 
-  { NULL, "Size",  1, 20, 16, 0, &slider_update_brush_size },
-  { NULL, "Ratio", 5, 20, 10, 1, &slider_update_aspect_ratio },
-  { NULL, "Scale", 2,  8,  4, 0, &slider_brush_magnification },
+  { NULL, "Size",  1, MAX_BRUSH_SIZE, 16, 0, &slider_update_brush_size, true },
+  { NULL, "Ratio", 5, 20, 10, 1, &slider_update_aspect_ratio, true },
+  { NULL, "Scale", 2,  8,  4, 0, &slider_brush_magnification, true },
 
-  { NULL, "Thickness", 1, 6, 2, 1, &slider_brush_thickness },
+  { NULL, "Thickness", 1, 6, 2, 1, &slider_brush_thickness, true },
+  { NULL, "Spacing",   1, 100, 25, 0, &slider_dab_spacing, false },
 
-  { NULL, NULL, 0, 0, 0, 0, NULL }
+  { NULL, NULL, 0, 0, 0, 0, NULL, false }
 };
 
 
 /* CANVASES. */
 
+/* While the button is up only every other motion event moves the cursor.
+   While the button is down every event is handled, since the stroke is
+   interpolated between consecutive positions of the pointer anyway. */
+
 int mouse_action_delay = 2;
 
 static void
 mouse_action( int xx, int yy, unsigned int clicked )
 {
-  if ( SAMPLE == brush_selection && clicked )
+  /* The pointer comes in window coordinates, which are not those of the
+     image once the view of the canvas is zoomed or panned. */
+  bool inside = WindowToCanvas( &Canvases[0], xx, yy, &xx, &yy );
+  if ( clicked )
   {
     move_cursor( xx, yy, clicked );
+    mouse_action_delay = 2;
+    return;
+  }
+  end_stroke();
+  if ( !inside )
+  {
+    SetCanvasOverlay( &Canvases[0], 0, 0, 0, NULL, NULL, 0 );
+    mouse_action_delay = 2;
+    return;
   }
-  else if ( --mouse_action_delay ) return;
+  if ( --mouse_action_delay ) return;
   move_cursor( xx, yy, clicked );
   mouse_action_delay = 2;
 }
@@ -301,9 +371,9 @@ LoadPPM(char *Name)
     printf("Load failed!\n");
     return;
   }
-  ResizeCanvas(&Canvases[0], NewCanvas.Width, NewCanvas.Height);
-  memcpy(Canvases[0].Pixels, NewCanvas.Pixels, sizeof(long) * NewCanvas.Width * NewCanvas.Height);
-  free(NewCanvas.Pixels);
+  AdoptCanvasPixels(&Canvases[0], NewCanvas.Pixels, NewCanvas.Width, NewCanvas.Height);
+  invalidate_canvas_stats();
+  clear_history();
   UpdateCanvas(&Canvases[0],0,Canvases[0].Width-1,0,Canvases[0].Height-1);
 }
 
@@ -492,28 +562,32 @@ static void
 reset_canvas()
 {
   ResizeCanvas( &Canvases[0], 256, 256 );
-  for ( int ii = 0; ii < 256; ++ii )
+  for ( int jj = 0; jj < 256; ++jj )
   {
-    for ( int jj = 0; jj < 256; ++jj )
+    CanvasPixel* row = CANVAS_ROW( &Canvases[0], jj );
+    for ( int ii = 0; ii < 256; ++ii )
     {
-      SET_RED  ( PIXEL( &Canvases[0], ii, jj ), jj );
-      SET_GREEN( PIXEL( &Canvases[0], ii, jj ), ii );
-      SET_BLUE ( PIXEL( &Canvases[0], ii, jj ),  0 );
+      SET_RED  ( row[ii], jj );
+      SET_GREEN( row[ii], ii );
+      SET_BLUE ( row[ii],  0 );
     }
   }
+  invalidate_canvas_stats();
+  clear_history();
   UpdateCanvas( &Canvases[0], 0, Canvases[0].Width-1, 0, Canvases[0].Height-1 );
 }
 
 /*  Fill a canvas with a color in pixel parameter. */
 
 static void
-fill_canvas( Canvas* canvas, unsigned long pixel )
+fill_canvas( Canvas* canvas, CanvasPixel pixel )
 {
-  for ( int ii = 0; ii < canvas->Width; ++ii )
+  for ( int jj = 0; jj < canvas->Height; ++jj )
   {
-    for ( int jj = 0; jj < canvas->Height; ++jj )
+    CanvasPixel* row = CANVAS_ROW( canvas, jj );
+    for ( int ii = 0; ii < canvas->Width; ++ii )
     {
-      PIXEL( canvas, ii, jj ) = pixel;
+      row[ii] = pixel;
     }
   }
 }
@@ -523,14 +597,33 @@ fill_canvas( Canvas* canvas, unsigned long pixel )
 static void
 fill_canvas0()
 {
-  unsigned long pixel = 0;
+  CanvasPixel pixel = 0;
   SET_RED( pixel, Rcomponent );
   SET_GREEN( pixel, Gcomponent );
   SET_BLUE( pixel, Bcomponent );
+  begin_history_record();
+  save_history_tiles( 0, 0, Canvases[0].Width, Canvases[0].Height );
   fill_canvas( &Canvases[0], pixel );
+  end_history_record();
+  invalidate_canvas_stats();
   UpdateCanvas( &Canvases[0], 0, Canvases[0].Width - 1, 0, Canvases[0].Height - 1 );
 }
 
+/*  Fill the rectangle [X0, X1) x [Y0, Y1) of a canvas with a color. */
+
+static void
+fill_canvas_rect( Canvas* canvas, int X0, int Y0, int X1, int Y1, CanvasPixel pixel )
+{
+  for ( int jj = Y0; jj < Y1; ++jj )
+  {
+    CanvasPixel* row = CANVAS_ROW( canvas, jj );
+    for ( int ii = X0; ii < X1; ++ii )
+    {
+      row[ii] = pixel;
+    }
+  }
+}
+
 /*  Fill the visualization canvas with its color. */
 
 static void
@@ -608,6 +701,116 @@ hsv2rgb( float hue, float sat, float val, float* rr, float* gg, float* bb )
   }
 }
 
+/* Fixed-point HSV.  The tinting brush and the cursor convert every pixel they
+   visit, so they use integer versions of rgb2hsv() and hsv2rgb(), in which
+   the divides by the chroma and by the value of a color are replaced by
+   multiplications with a table of reciprocals.  The components of a
+   fixed_hsv are scaled integers:
+
+     hue  0 .. HSV_HUE_FULL - 1, HSV_ONE per 60 degrees,
+     sat  0 .. HSV_ONE, where HSV_ONE stands for 1.0,
+     val  0 .. 255 << 8, the color component scale with 8 fractional bits.
+
+   A color converted to fixed_hsv and back is reproduced exactly, and the hue
+   and the saturation differ from those computed by rgb2hsv() by at most one
+   unit, 2^-16 of a sextant or of full saturation.  "paint -check-hsv" checks
+   both bounds exhaustively over all 2^24 colors; see check_hsv(). */
+
+#define HSV_ONE       ( 1 << 16 )
+#define HSV_HUE_FULL  ( 6 * HSV_ONE )
+#define HSV_HUE_HALF  ( 3 * HSV_ONE )
+
+typedef struct {
+  int hue;
+  int sat;
+  int val;
+} fixed_hsv;
+
+/* hsv_recip[dd] is 2^24 / dd rounded up. */
+
+static int hsv_recip[256];
+
+static void
+init_fixed_hsv()
+{
+  hsv_recip[0] = 0;
+  for ( int dd = 1; dd < 256; ++dd )
+  {
+    hsv_recip[dd] = ( ( 1 << 24 ) + dd - 1 ) / dd;
+  }
+}
+
+/* Convert the color components RR, GG and BB in 0..255 to HSV.  As with
+   rgb2hsv() the hue is left unchanged when the saturation is 0. */
+
+static inline void
+rgb2hsv_fixed( int rr, int gg, int bb, fixed_hsv* hsv )
+{
+  int max = MAX( MAX( rr, gg ), bb );
+  int min = MIN( MIN( rr, gg ), bb );
+  int delta = max - min;
+
+  hsv->val = max << 8;
+  if ( 0 == delta )
+  {
+    hsv->sat = 0;
+    return;
+  }
+  hsv->sat = ( delta * hsv_recip[max] ) >> 8;
+
+  int base, num;
+  if ( rr == max )
+  {
+    base = 0;
+    num = gg - bb;
+  }
+  else if ( gg == max )
+  {
+    base = 2 * HSV_ONE;
+    num = bb - rr;
+  }
+  else
+  {
+    base = 4 * HSV_ONE;
+    num = rr - gg;
+  }
+  int frac = ( ( num < 0 ? -num : num ) * hsv_recip[delta] ) >> 8;
+  int hue = base + ( num < 0 ? -frac : frac );
+  hsv->hue = ( hue < 0 ) ? hue + HSV_HUE_FULL : hue;
+}
+
+/* Convert HSV back to color components in 0..255, rounded to nearest. */
+
+static inline void
+hsv2rgb_fixed( const fixed_hsv* hsv, int* rr, int* gg, int* bb )
+{
+  int val = hsv->val;
+  if ( 0 == hsv->sat )
+  {
+    *rr = *gg = *bb = ( val + 0x80 ) >> 8;
+    return;
+  }
+
+  int hue = ( hsv->hue >= HSV_HUE_FULL ) ? hsv->hue - HSV_HUE_FULL : hsv->hue;
+  int ii = hue >> 16;
+  int ff = hue & ( HSV_ONE - 1 );
+  int sat = hsv->sat;
+  const long long half = 1 << 23;
+  int pp = ( (long long) val * ( HSV_ONE - sat ) + half ) >> 24;
+  int qq = ( (long long) val * ( HSV_ONE - ( ( (long long) sat * ff ) >> 16 ) ) + half ) >> 24;
+  int tt = ( (long long) val * ( HSV_ONE - ( ( (long long) sat * ( HSV_ONE - ff ) ) >> 16 ) ) + half ) >> 24;
+  int vv = ( val + 0x80 ) >> 8;
+  switch ( ii )
+  {
+  case 0: *rr = vv; *gg = tt; *bb = pp; break;
+  case 1: *rr = qq; *gg = vv; *bb = pp; break;
+  case 2: *rr = pp; *gg = vv; *bb = tt; break;
+  case 3: *rr = pp; *gg = qq; *bb = vv; break;
+  case 4: *rr = tt; *gg = pp; *bb = vv; break;
+  default: *rr = vv; *gg = pp; *bb = qq; break;
+  }
+}
+
 /*  When the brush color changed in RGB, this function is called to update HSV
     sliders.  Hue is deliberately left undefined. If Saturation changed to 0.0,
     hue retains its old value. */
@@ -651,78 +854,89 @@ adjust_rgb()
 static void
 overpaint( int X0, int Y0, int X1, int Y1, Canvas* canvas )
 {
-  for ( int ii = X0; ii < X1; ++ii )
+  for ( int jj = Y0; jj < Y1; ++jj )
   {
-    for ( int jj = Y0; jj < Y1; ++jj )
+    CanvasSpan span = CanvasRowSpan( canvas, X0, X1 - 1, jj );
+    for ( int ii = 0; ii < span.Length; ++ii )
     {
-      unsigned long pixel = PIXEL( canvas, ii, jj );
+      CanvasPixel pixel = span.Pixels[ii];
       SET_RED  ( pixel, Rcomponent );
       SET_GREEN( pixel, Gcomponent );
       SET_BLUE ( pixel, Bcomponent );
-      PIXEL( canvas, ii, jj ) = pixel;
+      span.Pixels[ii] = pixel;
     }
   }
 }
 
-/* Compute the value of a pixel in a tinted brushing procedure. */
+/* The tinting brush: its color in HSV, both in float for the vector kernels
+   and in fixed point for tint_pixel(), and the tinted components. */
+
+typedef struct {
+  float hue;
+  float sat;
+  float val;
+  int component;
+  fixed_hsv fixed;
+} tint_brush;
+
+/* Blend FROM toward TO by the weight AA, HSV_ONE standing for 1.0. */
+
+static inline int
+hsv_blend( int from, int to, int aa )
+{
+  return ( (long long) ( HSV_ONE - aa ) * from + (long long) aa * to + HSV_ONE / 2 ) >> 16;
+}
+
+/* Compute the value of a pixel in a tinted brushing procedure.  The weight
+   ALPHA is clamped to 0..1. */
 
-static unsigned long
-tint_pixel( float br_hue, float br_sat, float br_val, float alpha, unsigned long pixel )
+static CanvasPixel
+tint_pixel( const tint_brush* brush, float alpha, CanvasPixel pixel )
 {
-  float rr, gg, bb;
-  float hh = br_hue, ss, vv;
+  const fixed_hsv* br = &brush->fixed;
+  int aa = (int) ( alpha * HSV_ONE + 0.5 );
+  aa = MIN( MAX( aa, 0 ), HSV_ONE );
 
   // this is the canvas pixel conversion to HSV.
-  rr = GET_RED  ( pixel ) / 255.0;
-  gg = GET_GREEN( pixel ) / 255.0;
-  bb = GET_BLUE ( pixel ) / 255.0;
-  rgb2hsv( rr, gg, bb, &hh, &ss, &vv );
+  fixed_hsv hsv = { br->hue, 0, 0 };
+  rgb2hsv_fixed( GET_RED( pixel ), GET_GREEN( pixel ), GET_BLUE( pixel ), &hsv );
+  bool neutral = ( 0 == hsv.sat );
 
   // this is the new pixel in HSV.
-  if ( ( brush_component & HUE ) && ( 0.0 != br_sat ) )
+  if ( ( brush->component & HUE ) && ( 0 != br->sat ) && !neutral )
   {
-    float tmp_hue = br_hue;
-    if ( 0.0 != ss )
+    int hh = hsv.hue;
+    int tmp_hue = br->hue;
+    if ( hh < tmp_hue && tmp_hue - hh > HSV_HUE_HALF )
     {
-      if ( hh < tmp_hue && tmp_hue - hh > 180 )
-      {
-        tmp_hue -= 360.0;
-      }
-      else if ( hh > tmp_hue && hh - tmp_hue > 180 )
-      {
-        hh -= 360.0;
-      }
-      hh = ( 1.0 - alpha ) * hh + alpha * tmp_hue;
-      if ( hh < 0.0 )
-      {
-        hh += 360.0;
-      }
+      tmp_hue -= HSV_HUE_FULL;
+    }
+    else if ( hh > tmp_hue && hh - tmp_hue > HSV_HUE_HALF )
+    {
+      hh -= HSV_HUE_FULL;
     }
-    /* otherwise hh already set to be the same as brush's. */
+    hh = hsv_blend( hh, tmp_hue, aa );
+    hsv.hue = ( hh < 0 ) ? hh + HSV_HUE_FULL : hh;
   }
+  /* otherwise a neutral pixel already has the hue of the brush. */
+
   /* If the canvas color is neutral and HUE change is not requested then it
      should remain neutral, even though the brush may be not neutral. */
-  if ( ( brush_component & SAT ) &&  ( ( 0.0 != ss ) || ( brush_component & HUE ) ) )
+  if ( ( brush->component & SAT ) && ( !neutral || ( brush->component & HUE ) ) )
   {
-    ss = ( 1.0 - alpha ) * ss + alpha * br_sat;
+    hsv.sat = hsv_blend( hsv.sat, br->sat, aa );
   }
-  if ( brush_component & VAL )
+  if ( brush->component & VAL )
   {
-    vv = ( 1.0 - alpha ) * vv + alpha * br_val;
+    hsv.val = hsv_blend( hsv.val, br->val, aa );
   }
 
   // this is the new canvas pixel conversion to RGB.
-  hsv2rgb( hh, ss, vv, &rr, &gg, &bb );
-  SET_RED  ( pixel, (unsigned long)(rr * 255) );
-  SET_GREEN( pixel, (unsigned long)(gg * 255) );
-  SET_BLUE ( pixel, (unsigned long)(bb * 255) );
-
-  if ( 1.0 < rr || 0.0 > rr || 1.0 < gg || 0.0 > gg || 1.0 < bb || 0.0 > bb )
-  {
-    DOUT(( "FATAL ERROR: (rgb) (%4.2f, %4.2f, %4.2f) (hsv) (%4.0f, %4.2f, %4.2f)\n",
-           rr, gg, bb, hh, ss, vv ));
-  }
-
+  int rr, gg, bb;
+  hsv2rgb_fixed( &hsv, &rr, &gg, &bb );
+  SET_RED  ( pixel, rr );
+  SET_GREEN( pixel, gg );
+  SET_BLUE ( pixel, bb );
   return pixel;
 }
 
@@ -747,334 +961,2207 @@ compute_alpha( int xx, int yy )
   return alpha;
 }
 
-static void
-tinting( int OX, int OY, int X0, int Y0, int X1, int Y1, Canvas* canvas )
-{
-  float br_hue;
-  float br_sat;
-  float br_val;
+/* The weighted mask of the brush.  compute_alpha() is evaluated once for every
+   pixel of the brush rectangle and the values are kept row by row in shape.
+   weight holds the same values scaled by the brush thickness, which is what
+   the tinting brush applies.  The mask is rebuilt by update_brush_mask() only
+   when the size, the aspect ratio or the thickness of the brush change. */
 
-  // This is the brush in HSV.
-  rgb2hsv( Rcomponent / 255.0, Gcomponent / 255.0, Bcomponent / 255.0, &br_hue, &br_sat, &br_val );
+static struct {
+  int width;
+  int height;
+  float thickness;
+  float* shape;
+  float* weight;
+} brush_mask = { 0, 0, 0.0, NULL, NULL };
 
-  int I0 = OX - brush_width / 2;
-  int J0 = OY - brush_height / 2;
-  int i0 = X0 - I0;
-  int i1 = X1 - I0;
-  int j0 = Y0 - J0;
-  int j1 = Y1 - J0;
-  int xx = X0;
-  int yy = Y0;
+#define MASK_SHAPE( II, JJ )  ( brush_mask.shape[ (JJ) * brush_mask.width + (II) ] )
+#define MASK_WEIGHT( II, JJ ) ( brush_mask.weight[ (JJ) * brush_mask.width + (II) ] )
 
-  if ( i0 >= i1 || j0 >= j1 )
+static void
+update_brush_mask()
+{
+  if ( brush_mask.shape && brush_width == brush_mask.width
+       && brush_height == brush_mask.height && brush_thickness == brush_mask.thickness )
   {
-    DOUT(( "BRUSH AREA (%d,%d) (%d,%d)\n", i0, j0, i1, j1 ));
-    DOUT(( "OX, OY (%d,%d) X0, Y0 : (%d,%d) X1, Y1 : (%d,%d)\n",
-           OX, OY, X0, Y0, X1, Y1 ));
+    return;
   }
-
-  for ( int ii = i0; ii < i1; ++ii )
+  int size = brush_width * brush_height;
+  if ( size != brush_mask.width * brush_mask.height || !brush_mask.shape )
   {
-    yy = Y0;
-    for ( int jj = j0; jj < j1; ++jj )
+    free( brush_mask.shape );
+    free( brush_mask.weight );
+    brush_mask.shape = (float*) malloc( size * sizeof( float ) );
+    brush_mask.weight = (float*) malloc( size * sizeof( float ) );
+    if ( !brush_mask.shape || !brush_mask.weight )
     {
-      float alpha = brush_thickness * compute_alpha( ii, jj );
-      PIXEL( canvas, xx, yy ) = tint_pixel( br_hue, br_sat, br_val, alpha, PIXEL( canvas, xx, yy ) );
-      ++yy;
+      fprintf( stderr, "Not enough memory for the brush mask.\n" );
+      exit( 1 );
     }
-    ++xx;
   }
-} // tinting
+  brush_mask.width = brush_width;
+  brush_mask.height = brush_height;
+  brush_mask.thickness = brush_thickness;
+  for ( int jj = 0; jj < brush_height; ++jj )
+  {
+    for ( int ii = 0; ii < brush_width; ++ii )
+    {
+      float alpha = compute_alpha( ii, jj );
+      MASK_SHAPE( ii, jj ) = alpha;
+      MASK_WEIGHT( ii, jj ) = brush_thickness * alpha;
+    }
+  }
+  update_cursor_outline();
+}
+
+/* The outline of the brush, which is drawn as the cursor: the pixels of the
+   brush shape next to a pixel outside of it, given by their offsets from the
+   top left corner of the brush.  It is rebuilt by update_cursor_outline()
+   only when the size of the brush changes, so drawing the cursor costs the
+   same per outline pixel for any brush. */
 
+static struct {
+  int width;
+  int height;
+  int count;
+  int* xx;
+  int* yy;
+} cursor_outline = { 0, 0, 0, NULL, NULL };
 
-/*  Actually apply the brush to the canvas. */
+static bool
+in_brush_shape( int ii, int jj )
+{
+  return 0 <= ii && ii < brush_mask.width && 0 <= jj && jj < brush_mask.height
+         && MASK_SHAPE( ii, jj ) > 0.0;
+}
 
 static void
-apply_brush( int X, int Y )
+update_cursor_outline()
 {
-/*     DOUT(( "BRUSH ORIGIN (%d, %d) in [%d x %d] ", */
-/*            X, Y, Canvases[0].Width, Canvases[0].Height )); */
-/*     DOUT(( "SIZE [%d : %d] COLOR <%d, %d, %d>\n", */
-/*            brush_width, brush_height, Rcomponent, Gcomponent, Bcomponent )); */
-  if ( SAMPLE == brush_selection )
+  if ( cursor_outline.xx && cursor_outline.width == brush_mask.width
+       && cursor_outline.height == brush_mask.height )
+  {
     return;
-
-  int CW = Canvases[0].Width;
-  int CH = Canvases[0].Height;
-  int LX = X - brush_width / 2;
-  if ( LX >= CW ) return;
-  int RX = LX + brush_width;
-  if ( RX <= 0 ) return;
-  int BY = Y - brush_height / 2;
-  if ( BY >= CH ) return;
-  int TY = BY + brush_height;
-  if ( TY <= 0 ) return;
-  int X0 = ( LX < 0 ) ? 0 : LX;
-  int Y0 = ( BY < 0 ) ? 0 : BY;
-  int X1 = ( RX < CW ) ? RX : CW;
-  int Y1 = ( TY < CH ) ? TY : CH;
-
-  if ( TINT == brush_selection && brush_component )
+  }
+  int size = brush_mask.width * brush_mask.height;
+  free( cursor_outline.xx );
+  free( cursor_outline.yy );
+  cursor_outline.xx = (int*) malloc( MAX( size, 1 ) * sizeof( int ) );
+  cursor_outline.yy = (int*) malloc( MAX( size, 1 ) * sizeof( int ) );
+  if ( !cursor_outline.xx || !cursor_outline.yy )
   {
-    tinting( X, Y, X0, Y0, X1, Y1, &Canvases[0] );
+    fprintf( stderr, "Not enough memory for the cursor.\n" );
+    exit( 1 );
   }
-  else
+  cursor_outline.width = brush_mask.width;
+  cursor_outline.height = brush_mask.height;
+  cursor_outline.count = 0;
+  for ( int jj = 0; jj < brush_mask.height; ++jj )
   {
-    overpaint( X0, Y0, X1, Y1, &Canvases[0] );
+    for ( int ii = 0; ii < brush_mask.width; ++ii )
+    {
+      if ( in_brush_shape( ii, jj )
+           && ( !in_brush_shape( ii - 1, jj ) || !in_brush_shape( ii + 1, jj )
+                || !in_brush_shape( ii, jj - 1 ) || !in_brush_shape( ii, jj + 1 ) ) )
+      {
+        cursor_outline.xx[cursor_outline.count] = ii;
+        cursor_outline.yy[cursor_outline.count] = jj;
+        ++cursor_outline.count;
+      }
+    }
   }
+}
 
-  /*     DOUT(( "UPDATE (%d, %d) x (%d, %d)\n", X0, Y0, X1 - 1, Y1 - 1 )); */
-
-  UpdateCanvas( &Canvases[0], X0, X1 - 1, Y0, Y1 - 1 );
-} // apply_brush
+/* Row kernels of the tinting brush.  A row kernel tints COUNT consecutive
+   pixels of a canvas row, the pixel ROW[ii] with the weight ALPHA[ii].  The
+   scalar kernel calls tint_pixel() for every pixel.  The vector kernels do
+   the same RGB -> HSV -> RGB round trip in float on 4 (SSE4.1) or 8 (AVX2)
+   pixels at once, replacing the branches of rgb2hsv(), tint_pixel() and
+   hsv2rgb() by blends.  Only the way around the hue circle is decided on
+   the fixed-point hues, as tint_pixel() decides it, so a pixel of hue
+   opposite to the brush turns the same way on every processor.  Their
+   results match the fixed-point tint_pixel() within 1 per color component.
+   The kernel is selected once at startup by select_tint_kernel(). */
 
-/* Prepare the image of a brush for visualization. */
+typedef void (*tint_row_kernel)( CanvasPixel* row, const float* alpha, int count,
+                                 const tint_brush* brush );
 
 static void
-brush_visualization()
+tint_row_scalar( CanvasPixel* row, const float* alpha, int count, const tint_brush* brush )
 {
-  Canvas* canvas = &Canvases[1];
-  int OX = canvas->Width / 2;
-  int OY = canvas->Height / 2;
-  int X0 = OX - brush_width / 2;
-  int X1 = X0 + brush_width;
-  int Y0 = OY - brush_height / 2;
-  int Y1 = Y0 + brush_height;
+  for ( int ii = 0; ii < count; ++ii )
+  {
+    row[ii] = tint_pixel( brush, alpha[ii], row[ii] );
+  }
+}
 
-  init_visual_canvas();
-  if ( TINT == brush_selection && brush_component )
+#ifdef TINT_SIMD
+
+/* The hue of 4 pixels in fixed point, computed exactly as rgb2hsv_fixed()
+   does, so that the vector kernels blend the hue around the hue circle in
+   the same direction as tint_pixel().  The hue of a neutral pixel is
+   undefined. */
+
+__attribute__(( target( "sse4.1" ) ))
+static inline __m128i
+fixed_hue_sse41( __m128i pix )
+{
+  const __m128i byte = _mm_set1_epi32( 0xff );
+  const __m128i zero = _mm_setzero_si128();
+  __m128i rr = _mm_and_si128( pix, byte );
+  __m128i gg = _mm_and_si128( _mm_srli_epi32( pix, 8 ), byte );
+  __m128i bb = _mm_and_si128( _mm_srli_epi32( pix, 16 ), byte );
+  __m128i max = _mm_max_epi32( _mm_max_epi32( rr, gg ), bb );
+  __m128i delta = _mm_sub_epi32( max, _mm_min_epi32( _mm_min_epi32( rr, gg ), bb ) );
+  __m128i is_red = _mm_cmpeq_epi32( rr, max );
+  __m128i is_green = _mm_cmpeq_epi32( gg, max );
+  __m128i base = _mm_blendv_epi8( _mm_set1_epi32( 4 * HSV_ONE ), _mm_set1_epi32( 2 * HSV_ONE ), is_green );
+  __m128i num = _mm_blendv_epi8( _mm_sub_epi32( rr, gg ), _mm_sub_epi32( bb, rr ), is_green );
+  base = _mm_andnot_si128( is_red, base );
+  num = _mm_blendv_epi8( num, _mm_sub_epi32( gg, bb ), is_red );
+  __m128i recip = _mm_set_epi32( hsv_recip[ _mm_extract_epi32( delta, 3 ) ],
+                                 hsv_recip[ _mm_extract_epi32( delta, 2 ) ],
+                                 hsv_recip[ _mm_extract_epi32( delta, 1 ) ],
+                                 hsv_recip[ _mm_extract_epi32( delta, 0 ) ] );
+  __m128i frac = _mm_srli_epi32( _mm_mullo_epi32( _mm_abs_epi32( num ), recip ), 8 );
+  __m128i hue = _mm_add_epi32( base, _mm_sign_epi32( frac, num ) );
+  return _mm_add_epi32( hue, _mm_and_si128( _mm_cmpgt_epi32( zero, hue ), _mm_set1_epi32( HSV_HUE_FULL ) ) );
+}
+
+/* Tint 4 pixels, given and returned as 32 bit integers. */
+
+__attribute__(( target( "sse4.1" ) ))
+static inline __m128i
+tint_lanes_sse41( __m128i pix, __m128 alpha, const tint_brush* brush )
+{
+  const __m128i byte = _mm_set1_epi32( 0xff );
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps( 1.0 );
+  const __m128 c255 = _mm_set1_ps( 255.0 );
+  const __m128 c360 = _mm_set1_ps( 360.0 );
+
+  /* rgb2hsv() */
+  __m128 rr = _mm_div_ps( _mm_cvtepi32_ps( _mm_and_si128( pix, byte ) ), c255 );
+  __m128 gg = _mm_div_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( pix, 8 ), byte ) ), c255 );
+  __m128 bb = _mm_div_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( pix, 16 ), byte ) ), c255 );
+  __m128 max = _mm_max_ps( _mm_max_ps( rr, gg ), bb );
+  __m128 min = _mm_min_ps( _mm_min_ps( rr, gg ), bb );
+  __m128 delta = _mm_sub_ps( max, min );
+  __m128 vv = max;
+  __m128 neutral = _mm_cmpeq_ps( delta, zero );
+  __m128 ss = _mm_andnot_ps( neutral, _mm_div_ps( delta, _mm_blendv_ps( max, one, neutral ) ) );
+  __m128 divisor = _mm_blendv_ps( delta, one, neutral );
+  __m128 hh = _mm_add_ps( _mm_set1_ps( 4.0 ), _mm_div_ps( _mm_sub_ps( rr, gg ), divisor ) );
+  hh = _mm_blendv_ps( hh, _mm_add_ps( _mm_set1_ps( 2.0 ), _mm_div_ps( _mm_sub_ps( bb, rr ), divisor ) ),
+                      _mm_cmpeq_ps( gg, max ) );
+  hh = _mm_blendv_ps( hh, _mm_div_ps( _mm_sub_ps( gg, bb ), divisor ), _mm_cmpeq_ps( rr, max ) );
+  hh = _mm_mul_ps( hh, _mm_set1_ps( 60.0 ) );
+  hh = _mm_add_ps( hh, _mm_and_ps( _mm_cmplt_ps( hh, zero ), c360 ) );
+  hh = _mm_blendv_ps( hh, _mm_set1_ps( brush->hue ), neutral );
+
+  /* tint_pixel() */
+  __m128 beta = _mm_sub_ps( one, alpha );
+  if ( ( brush->component & HUE ) && 0.0 != brush->sat )
   {
-    /* to make it look closer to what it may look like on canvas apply the
-       tinting several times. */
-    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
-    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
-    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
-    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
-    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
+    /* the way around the hue circle is chosen on the fixed-point hues. */
+    __m128i fixed = fixed_hue_sse41( pix );
+    __m128i br_fixed = _mm_set1_epi32( brush->fixed.hue );
+    __m128i half = _mm_set1_epi32( HSV_HUE_HALF );
+    __m128 wrap_brush = _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_sub_epi32( br_fixed, fixed ), half ) );
+    __m128 wrap_pixel = _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_sub_epi32( fixed, br_fixed ), half ) );
+    __m128 tmp_hue = _mm_sub_ps( _mm_set1_ps( brush->hue ), _mm_and_ps( wrap_brush, c360 ) );
+    __m128 hue = _mm_sub_ps( hh, _mm_and_ps( wrap_pixel, c360 ) );
+    hue = _mm_add_ps( _mm_mul_ps( beta, hue ), _mm_mul_ps( alpha, tmp_hue ) );
+    hue = _mm_add_ps( hue, _mm_and_ps( _mm_cmplt_ps( hue, zero ), c360 ) );
+    hh = _mm_blendv_ps( hue, hh, neutral );
   }
-  else
+  if ( brush->component & SAT )
   {
-    overpaint( X0, Y0, X1, Y1, canvas );
+    __m128 sat = _mm_add_ps( _mm_mul_ps( beta, ss ), _mm_mul_ps( alpha, _mm_set1_ps( brush->sat ) ) );
+    ss = ( brush->component & HUE ) ? sat : _mm_blendv_ps( sat, ss, neutral );
   }
-
-  for ( int ii = 0; ii < brush_width; ++ii )
+  if ( brush->component & VAL )
   {
-    for ( int jj = 0; jj < brush_height; ++ jj )
-    {
-      brush_pixels[ii][jj] = PIXEL( canvas, X0 + ii, Y0 + jj );
-    }
+    vv = _mm_add_ps( _mm_mul_ps( beta, vv ), _mm_mul_ps( alpha, _mm_set1_ps( brush->val ) ) );
   }
 
-  int bw = brush_magnif * brush_width;
-  int bh = brush_magnif * brush_height;
-  X0 = ( canvas->Width - bw ) / 2;
-  X1 = X0 + bw;
-  Y0 = ( canvas->Height - bh ) / 2;
-  Y1 = Y0 + bh;
+  /* hsv2rgb() */
+  hh = _mm_andnot_ps( _mm_cmpeq_ps( hh, c360 ), hh );
+  hh = _mm_div_ps( hh, _mm_set1_ps( 60.0 ) );
+  __m128i sextant = _mm_min_epi32( _mm_cvttps_epi32( hh ), _mm_set1_epi32( 5 ) );
+  __m128 ff = _mm_sub_ps( hh, _mm_cvtepi32_ps( sextant ) );
+  __m128 pp = _mm_mul_ps( vv, _mm_sub_ps( one, ss ) );
+  __m128 qq = _mm_mul_ps( vv, _mm_sub_ps( one, _mm_mul_ps( ss, ff ) ) );
+  __m128 tt = _mm_mul_ps( vv, _mm_sub_ps( one, _mm_mul_ps( ss, _mm_sub_ps( one, ff ) ) ) );
+  __m128 is0 = _mm_castsi128_ps( _mm_cmpeq_epi32( sextant, _mm_set1_epi32( 0 ) ) );
+  __m128 is1 = _mm_castsi128_ps( _mm_cmpeq_epi32( sextant, _mm_set1_epi32( 1 ) ) );
+  __m128 is2 = _mm_castsi128_ps( _mm_cmpeq_epi32( sextant, _mm_set1_epi32( 2 ) ) );
+  __m128 is3 = _mm_castsi128_ps( _mm_cmpeq_epi32( sextant, _mm_set1_epi32( 3 ) ) );
+  __m128 is4 = _mm_castsi128_ps( _mm_cmpeq_epi32( sextant, _mm_set1_epi32( 4 ) ) );
+  __m128 is5 = _mm_castsi128_ps( _mm_cmpeq_epi32( sextant, _mm_set1_epi32( 5 ) ) );
+  rr = _mm_blendv_ps( _mm_blendv_ps( _mm_blendv_ps( pp, tt, is4 ), qq, is1 ), vv, _mm_or_ps( is0, is5 ) );
+  gg = _mm_blendv_ps( _mm_blendv_ps( _mm_blendv_ps( pp, qq, is3 ), tt, is0 ), vv, _mm_or_ps( is1, is2 ) );
+  bb = _mm_blendv_ps( _mm_blendv_ps( _mm_blendv_ps( pp, qq, is5 ), tt, is2 ), vv, _mm_or_ps( is3, is4 ) );
+  __m128 gray = _mm_cmpeq_ps( ss, zero );
+  rr = _mm_blendv_ps( rr, vv, gray );
+  gg = _mm_blendv_ps( gg, vv, gray );
+  bb = _mm_blendv_ps( bb, vv, gray );
+
+  __m128i out = _mm_cvtps_epi32( _mm_mul_ps( rr, c255 ) );
+  out = _mm_or_si128( out, _mm_slli_epi32( _mm_cvtps_epi32( _mm_mul_ps( gg, c255 ) ), 8 ) );
+  out = _mm_or_si128( out, _mm_slli_epi32( _mm_cvtps_epi32( _mm_mul_ps( bb, c255 ) ), 16 ) );
+  return _mm_or_si128( out, _mm_andnot_si128( _mm_set1_epi32( 0xffffff ), pix ) );
+}
 
-  for ( int ii = 0; ii < brush_width; ++ii )
-  {
-    for ( int jj = 0; jj < brush_height; ++ jj )
-    {
-      unsigned long pixel = brush_pixels[ii][jj];
-      /* 1:1 brush in the corner */
-      PIXEL( canvas, 40 + ii, 40 + jj ) = pixel;
-      /* magnified brush */
-      for ( int mm = 0; mm < brush_magnif; ++mm )
-      {
-        for ( int nn = 0; nn < brush_magnif; ++nn )
-        {
-          int XX = X0 + brush_magnif * ii + mm;
-          int YY = Y0 + brush_magnif * jj + nn;
-          PIXEL( canvas, XX, YY ) = pixel;
-        }
-      }
-    }
-  }
+/* The hue of 8 pixels in fixed point; see fixed_hue_sse41(). */
+
+__attribute__(( target( "avx2" ) ))
+static inline __m256i
+fixed_hue_avx2( __m256i pix )
+{
+  const __m256i byte = _mm256_set1_epi32( 0xff );
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i rr = _mm256_and_si256( pix, byte );
+  __m256i gg = _mm256_and_si256( _mm256_srli_epi32( pix, 8 ), byte );
+  __m256i bb = _mm256_and_si256( _mm256_srli_epi32( pix, 16 ), byte );
+  __m256i max = _mm256_max_epi32( _mm256_max_epi32( rr, gg ), bb );
+  __m256i delta = _mm256_sub_epi32( max, _mm256_min_epi32( _mm256_min_epi32( rr, gg ), bb ) );
+  __m256i is_red = _mm256_cmpeq_epi32( rr, max );
+  __m256i is_green = _mm256_cmpeq_epi32( gg, max );
+  __m256i base = _mm256_blendv_epi8( _mm256_set1_epi32( 4 * HSV_ONE ), _mm256_set1_epi32( 2 * HSV_ONE ), is_green );
+  __m256i num = _mm256_blendv_epi8( _mm256_sub_epi32( rr, gg ), _mm256_sub_epi32( bb, rr ), is_green );
+  base = _mm256_andnot_si256( is_red, base );
+  num = _mm256_blendv_epi8( num, _mm256_sub_epi32( gg, bb ), is_red );
+  __m256i recip = _mm256_i32gather_epi32( hsv_recip, delta, 4 );
+  __m256i frac = _mm256_srli_epi32( _mm256_mullo_epi32( _mm256_abs_epi32( num ), recip ), 8 );
+  __m256i hue = _mm256_add_epi32( base, _mm256_sign_epi32( frac, num ) );
+  return _mm256_add_epi32( hue, _mm256_and_si256( _mm256_cmpgt_epi32( zero, hue ), _mm256_set1_epi32( HSV_HUE_FULL ) ) );
 }
 
-/*  Actually update the canvas with the image of a visualized brush. */
+/* Tint 8 pixels, given and returned as 32 bit integers. */
 
-static void
-display_brush()
+__attribute__(( target( "avx2" ) ))
+static inline __m256i
+tint_lanes_avx2( __m256i pix, __m256 alpha, const tint_brush* brush )
 {
-  // if none of the HUE, SAT or VAL are selected don't redisplay the brush.
-  if ( 0 == brush_component && SAMPLE != brush_selection )
+  const __m256i byte = _mm256_set1_epi32( 0xff );
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps( 1.0 );
+  const __m256 c255 = _mm256_set1_ps( 255.0 );
+  const __m256 c360 = _mm256_set1_ps( 360.0 );
+
+  /* rgb2hsv() */
+  __m256 rr = _mm256_div_ps( _mm256_cvtepi32_ps( _mm256_and_si256( pix, byte ) ), c255 );
+  __m256 gg = _mm256_div_ps( _mm256_cvtepi32_ps( _mm256_and_si256( _mm256_srli_epi32( pix, 8 ), byte ) ), c255 );
+  __m256 bb = _mm256_div_ps( _mm256_cvtepi32_ps( _mm256_and_si256( _mm256_srli_epi32( pix, 16 ), byte ) ), c255 );
+  __m256 max = _mm256_max_ps( _mm256_max_ps( rr, gg ), bb );
+  __m256 min = _mm256_min_ps( _mm256_min_ps( rr, gg ), bb );
+  __m256 delta = _mm256_sub_ps( max, min );
+  __m256 vv = max;
+  __m256 neutral = _mm256_cmp_ps( delta, zero, _CMP_EQ_OQ );
+  __m256 ss = _mm256_andnot_ps( neutral, _mm256_div_ps( delta, _mm256_blendv_ps( max, one, neutral ) ) );
+  __m256 divisor = _mm256_blendv_ps( delta, one, neutral );
+  __m256 hh = _mm256_add_ps( _mm256_set1_ps( 4.0 ), _mm256_div_ps( _mm256_sub_ps( rr, gg ), divisor ) );
+  hh = _mm256_blendv_ps( hh, _mm256_add_ps( _mm256_set1_ps( 2.0 ), _mm256_div_ps( _mm256_sub_ps( bb, rr ), divisor ) ),
+                         _mm256_cmp_ps( gg, max, _CMP_EQ_OQ ) );
+  hh = _mm256_blendv_ps( hh, _mm256_div_ps( _mm256_sub_ps( gg, bb ), divisor ), _mm256_cmp_ps( rr, max, _CMP_EQ_OQ ) );
+  hh = _mm256_mul_ps( hh, _mm256_set1_ps( 60.0 ) );
+  hh = _mm256_add_ps( hh, _mm256_and_ps( _mm256_cmp_ps( hh, zero, _CMP_LT_OQ ), c360 ) );
+  hh = _mm256_blendv_ps( hh, _mm256_set1_ps( brush->hue ), neutral );
+
+  /* tint_pixel() */
+  __m256 beta = _mm256_sub_ps( one, alpha );
+  if ( ( brush->component & HUE ) && 0.0 != brush->sat )
   {
-    return;
+    /* the way around the hue circle is chosen on the fixed-point hues. */
+    __m256i fixed = fixed_hue_avx2( pix );
+    __m256i br_fixed = _mm256_set1_epi32( brush->fixed.hue );
+    __m256i half = _mm256_set1_epi32( HSV_HUE_HALF );
+    __m256 wrap_brush = _mm256_castsi256_ps( _mm256_cmpgt_epi32( _mm256_sub_epi32( br_fixed, fixed ), half ) );
+    __m256 wrap_pixel = _mm256_castsi256_ps( _mm256_cmpgt_epi32( _mm256_sub_epi32( fixed, br_fixed ), half ) );
+    __m256 tmp_hue = _mm256_sub_ps( _mm256_set1_ps( brush->hue ), _mm256_and_ps( wrap_brush, c360 ) );
+    __m256 hue = _mm256_sub_ps( hh, _mm256_and_ps( wrap_pixel, c360 ) );
+    hue = _mm256_add_ps( _mm256_mul_ps( beta, hue ), _mm256_mul_ps( alpha, tmp_hue ) );
+    hue = _mm256_add_ps( hue, _mm256_and_ps( _mm256_cmp_ps( hue, zero, _CMP_LT_OQ ), c360 ) );
+    hh = _mm256_blendv_ps( hue, hh, neutral );
   }
-  bool restore_sample_mode = false;
-  if ( SAMPLE == brush_selection )
+  if ( brush->component & SAT )
   {
-    restore_sample_mode = true;
-    brush_selection = visualized_brush;
+    __m256 sat = _mm256_add_ps( _mm256_mul_ps( beta, ss ), _mm256_mul_ps( alpha, _mm256_set1_ps( brush->sat ) ) );
+    ss = ( brush->component & HUE ) ? sat : _mm256_blendv_ps( sat, ss, neutral );
   }
-  brush_visualization();
-  UpdateCanvas( &Canvases[1], 0, Canvases[1].Width - 1, 0, Canvases[1].Height - 1 );
-  if ( restore_sample_mode )
+  if ( brush->component & VAL )
   {
-    brush_selection = SAMPLE;
+    vv = _mm256_add_ps( _mm256_mul_ps( beta, vv ), _mm256_mul_ps( alpha, _mm256_set1_ps( brush->val ) ) );
   }
+
+  /* hsv2rgb() */
+  hh = _mm256_andnot_ps( _mm256_cmp_ps( hh, c360, _CMP_EQ_OQ ), hh );
+  hh = _mm256_div_ps( hh, _mm256_set1_ps( 60.0 ) );
+  __m256i sextant = _mm256_min_epi32( _mm256_cvttps_epi32( hh ), _mm256_set1_epi32( 5 ) );
+  __m256 ff = _mm256_sub_ps( hh, _mm256_cvtepi32_ps( sextant ) );
+  __m256 pp = _mm256_mul_ps( vv, _mm256_sub_ps( one, ss ) );
+  __m256 qq = _mm256_mul_ps( vv, _mm256_sub_ps( one, _mm256_mul_ps( ss, ff ) ) );
+  __m256 tt = _mm256_mul_ps( vv, _mm256_sub_ps( one, _mm256_mul_ps( ss, _mm256_sub_ps( one, ff ) ) ) );
+  __m256 is0 = _mm256_castsi256_ps( _mm256_cmpeq_epi32( sextant, _mm256_set1_epi32( 0 ) ) );
+  __m256 is1 = _mm256_castsi256_ps( _mm256_cmpeq_epi32( sextant, _mm256_set1_epi32( 1 ) ) );
+  __m256 is2 = _mm256_castsi256_ps( _mm256_cmpeq_epi32( sextant, _mm256_set1_epi32( 2 ) ) );
+  __m256 is3 = _mm256_castsi256_ps( _mm256_cmpeq_epi32( sextant, _mm256_set1_epi32( 3 ) ) );
+  __m256 is4 = _mm256_castsi256_ps( _mm256_cmpeq_epi32( sextant, _mm256_set1_epi32( 4 ) ) );
+  __m256 is5 = _mm256_castsi256_ps( _mm256_cmpeq_epi32( sextant, _mm256_set1_epi32( 5 ) ) );
+  rr = _mm256_blendv_ps( _mm256_blendv_ps( _mm256_blendv_ps( pp, tt, is4 ), qq, is1 ), vv, _mm256_or_ps( is0, is5 ) );
+  gg = _mm256_blendv_ps( _mm256_blendv_ps( _mm256_blendv_ps( pp, qq, is3 ), tt, is0 ), vv, _mm256_or_ps( is1, is2 ) );
+  bb = _mm256_blendv_ps( _mm256_blendv_ps( _mm256_blendv_ps( pp, qq, is5 ), tt, is2 ), vv, _mm256_or_ps( is3, is4 ) );
+  __m256 gray = _mm256_cmp_ps( ss, zero, _CMP_EQ_OQ );
+  rr = _mm256_blendv_ps( rr, vv, gray );
+  gg = _mm256_blendv_ps( gg, vv, gray );
+  bb = _mm256_blendv_ps( bb, vv, gray );
+
+  __m256i out = _mm256_cvtps_epi32( _mm256_mul_ps( rr, c255 ) );
+  out = _mm256_or_si256( out, _mm256_slli_epi32( _mm256_cvtps_epi32( _mm256_mul_ps( gg, c255 ) ), 8 ) );
+  out = _mm256_or_si256( out, _mm256_slli_epi32( _mm256_cvtps_epi32( _mm256_mul_ps( bb, c255 ) ), 16 ) );
+  return _mm256_or_si256( out, _mm256_andnot_si256( _mm256_set1_epi32( 0xffffff ), pix ) );
 }
 
-/* A very dumb way to estimate the darkness of the background.  We need this to
-   show the cursor in a bright color when it's over dark part of the canvas.  */
+/* The vector kernels load and store packed 32 bit canvas pixels directly.
+   The last lanes of a row, and every lane when the canvas keeps pixels in
+   unsigned longs (XSUPPORT_LONG_PIXELS), are moved through a small buffer of
+   32 bit integers, which pads the unused lanes with zero weights. */
 
-static bool
-is_dark_canvas( int X0, int Y0, int X1, int Y1, Canvas* canvas )
+#define TINT_LANES 8
+
+static inline void
+gather_pixels( const CanvasPixel* row, const float* alpha, int count,
+               unsigned int* pixels, float* weights )
 {
-  int nn = 0;
-  float val = 0;
-  float hue = 0;
-  float sat = 0;
-  for ( int ii = X0; ii < X1; ++ii )
+  int ii = 0;
+  for ( ; ii < count; ++ii )
   {
-    for( int jj = Y0; jj < Y1; ++jj )
-    {
-      ++nn;
-      float rr, gg, bb, hh = 0, ss, vv;
-      unsigned long pixel = PIXEL( canvas, ii, jj );
-      rr = GET_RED  ( pixel ) / 255.0;
-      gg = GET_GREEN( pixel ) / 255.0;
-      bb = GET_BLUE ( pixel ) / 255.0;
-      rgb2hsv( rr, gg, bb, &hh, &ss, &vv );
-      val += vv;
-      hue += hh;
-      sat += ss;
-    }
+    pixels[ii] = row[ii];
+    weights[ii] = alpha[ii];
   }
-  val /= nn;
-  hue /= nn;
-  sat /= nn;
-  if ( (55 < hue && hue < 65 && val > 0.6) || val > 0.9 )
+  for ( ; ii < TINT_LANES; ++ii )
   {
-    return false;
+    pixels[ii] = 0;
+    weights[ii] = 0.0;
   }
-  return true;
 }
 
-/*  Draw a custom cursor.  Nothing smart here either. Very straightforward
-    implmenetation. Save the canavas pixels before they are overwritten with the
-    cursor pixels.  Next time when the cursor moves, restore the old pixels
-    first, possibly paint the brush if the button is down and finally draw the
-    cursor pixels in the new location.  We use alpha ranges close to the brush
-    outter edge to determine which pixels belong to the cursor. */
-
-static struct pixbuf {
-    int xx, yy;
-    unsigned long pixel;
-} canvas_pixel[50];
-
-struct alpharanges{
-    float left, right;
-} alphas[] = { {0.0, 1.0}, /* 0 */ {0.0, 1.0}, /* 1 */ {0.0, 1.0}, /* 2 */ {0.0, 1.0}, /* 3 */
-               {0.0, 1.0}, /* 4 */ {0.0, 0.1}, /* 5 */ {0.0, 0.1}, /* 6 */ {.01, 0.1}, /* 7 */
-               {.01, 0.1}, /* 8 */ {.02, 0.1}, /* 9 */ {.02, .08}, /* 0 */ {.02, .07}, /* 1 */
-               {.02, .06}, /* 2 */ {.02, .05}, /* 3 */ {.02, .05}, /* 4 */ {.02, .05}, /* 5 */
-               {.02, .05}, /* 6 */ {.02, .05}, /* 7 */ {.02, .05}, /* 8 */ {.02, .05}, /* 9 */
-};
+static inline void
+scatter_pixels( CanvasPixel* row, int count, const unsigned int* pixels )
+{
+  for ( int ii = 0; ii < count; ++ii )
+  {
+    row[ii] = pixels[ii];
+  }
+}
 
+__attribute__(( target( "sse4.1" ) ))
 static void
-move_cursor( int XX, int YY, unsigned int ButtonDown )
+tint_row_sse41( CanvasPixel* row, const float* alpha, int count, const tint_brush* brush )
 {
-  struct alpharanges* alpha_range = &alphas[ ( ( brush_width + brush_height ) / 2 ) - 1];
-
-  static int saved_pixels = -1;
-  static int PX0 = -1;
-  static int PX1 = -1;
-  static int PY0 = -1;
-  static int PY1 = -1;
+  unsigned int pixels[TINT_LANES] __attribute__(( aligned( 32 ) ));
+  float weights[TINT_LANES] __attribute__(( aligned( 32 ) ));
+  int ii = 0;
+#ifndef XSUPPORT_LONG_PIXELS
+  for ( ; ii + 4 <= count; ii += 4 )
+  {
+    __m128i pix = _mm_loadu_si128( (const __m128i*)( row + ii ) );
+    pix = tint_lanes_sse41( pix, _mm_loadu_ps( alpha + ii ), brush );
+    _mm_storeu_si128( (__m128i*)( row + ii ), pix );
+  }
+#endif
+  for ( ; ii < count; ii += 4 )
+  {
+    int lanes = MIN( 4, count - ii );
+    gather_pixels( row + ii, alpha + ii, lanes, pixels, weights );
+    __m128i pix = _mm_load_si128( (const __m128i*) pixels );
+    pix = tint_lanes_sse41( pix, _mm_load_ps( weights ), brush );
+    _mm_store_si128( (__m128i*) pixels, pix );
+    scatter_pixels( row + ii, lanes, pixels );
+  }
+}
 
-  bool out_of_screen = false;
-  unsigned long cursor_color = DARK_CURSOR;
-  Canvas* canvas = &Canvases[0];
+__attribute__(( target( "avx2" ) ))
+static void
+tint_row_avx2( CanvasPixel* row, const float* alpha, int count, const tint_brush* brush )
+{
+  unsigned int pixels[TINT_LANES] __attribute__(( aligned( 32 ) ));
+  float weights[TINT_LANES] __attribute__(( aligned( 32 ) ));
+  int ii = 0;
+#ifndef XSUPPORT_LONG_PIXELS
+  for ( ; ii + 8 <= count; ii += 8 )
+  {
+    __m256i pix = _mm256_loadu_si256( (const __m256i*)( row + ii ) );
+    pix = tint_lanes_avx2( pix, _mm256_loadu_ps( alpha + ii ), brush );
+    _mm256_storeu_si256( (__m256i*)( row + ii ), pix );
+  }
+#endif
+  for ( ; ii < count; ii += 8 )
+  {
+    int lanes = MIN( 8, count - ii );
+    gather_pixels( row + ii, alpha + ii, lanes, pixels, weights );
+    __m256i pix = _mm256_load_si256( (const __m256i*) pixels );
+    pix = tint_lanes_avx2( pix, _mm256_load_ps( weights ), brush );
+    _mm256_store_si256( (__m256i*) pixels, pix );
+    scatter_pixels( row + ii, lanes, pixels );
+  }
+}
+#endif /* TINT_SIMD */
 
-  int CW = canvas->Width;
-  int CH = canvas->Height;
-  int LX = XX - brush_width / 2;
-  if ( LX >= CW ) out_of_screen = true;
-  int RX = LX + brush_width;
-  if ( RX <= 0 ) out_of_screen = true;
-  int BY = YY - brush_height / 2;
-  if ( BY >= CH ) out_of_screen = true;
-  int TY = BY + brush_height;
-  if ( TY <= 0 ) out_of_screen = true;
-  int X0 = ( LX < 0 ) ? 0 : LX;
-  int Y0 = ( BY < 0 ) ? 0 : BY;
-  int X1 = ( RX < CW ) ? RX : CW;
-  int Y1 = ( TY < CH ) ? TY : CH;
+static tint_row_kernel tint_row = tint_row_scalar;
 
-  int I0 = XX - brush_width / 2;
-  int J0 = YY - brush_height / 2;
-  int i0 = X0 - I0;
-  int i1 = X1 - I0;
-  int j0 = Y0 - J0;
-  int j1 = Y1 - J0;
+/* Select the tinting row kernel by NAME, one of "scalar", "sse4.1" or
+   "avx2", or the fastest one the processor supports if NAME is NULL.
+   Return false if the requested kernel is not available. */
 
-  for ( ; saved_pixels >= 0; --saved_pixels )
+static bool
+select_tint_kernel( const char* name )
+{
+  tint_row = tint_row_scalar;
+#ifdef TINT_SIMD
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports( "avx2" );
+  bool sse41 = __builtin_cpu_supports( "sse4.1" );
+  if ( ( !name && avx2 ) || ( name && !strcmp( name, "avx2" ) && avx2 ) )
   {
-    struct pixbuf* pb = &canvas_pixel[saved_pixels];
-    PIXEL( canvas, pb->xx, pb->yy ) = pb->pixel;
+    tint_row = tint_row_avx2;
+    return true;
   }
-
-  if ( PX0 >= 0 )
+  if ( ( !name && sse41 ) || ( name && !strcmp( name, "sse4.1" ) && sse41 ) )
   {
-    UpdateCanvas( canvas, PX0, PX1, PY0, PY1 );
+    tint_row = tint_row_sse41;
+    return true;
   }
-  if ( out_of_screen )
+#endif
+  return !name || !strcmp( name, "scalar" );
+}
+
+/* Memo of tinted pixels.  During a stroke the brush does not change, so the
+   tinted value of a pixel depends only on the pixel and on its weight, and
+   flat areas of an image, such as the output of Fill, tint the same pixel
+   with the same weight over and over.  A tint cache is a direct-mapped table
+   keyed on the pixel and the bits of the weight, so a hit returns exactly
+   what the row kernel would.  The misses of a row are gathered and tinted by
+   the row kernel in one call.  Every thread tinting dabs has a cache of its
+   own.  The caches are emptied at the start of a stroke and whenever the
+   brush differs from the one the cached pixels were tinted with.
+
+   A lookup is not free, and the vector kernels tint a pixel in about the
+   time of a few lookups, so a cache only pays off if most lookups hit.  Every
+   TINT_CACHE_PROBE lookups a cache checks its hit rate, and if it is below
+   min_hits percent the next TINT_CACHE_BYPASS rows go straight to the row
+   kernel. */
+
+#define TINT_CACHE_BITS 12
+#define TINT_CACHE_SIZE ( 1 << TINT_CACHE_BITS )
+#define TINT_CACHE_EMPTY (~(uint64_t) 0)
+#define TINT_CACHE_PROBE 1024
+#define TINT_CACHE_BYPASS 256
+
+typedef struct {
+  uint64_t key[TINT_CACHE_SIZE];
+  CanvasPixel value[TINT_CACHE_SIZE];
+  int probe;
+  int probe_hits;
+  int bypass;
+  long hits;
+  long misses;
+  long bypassed;
+} tint_cache;
+
+static struct {
+  bool enabled;
+  int min_hits;
+  int count;
+  tint_cache* caches;
+  bool valid;
+  tint_brush brush;
+} tint_caches = { true, 0, 0, NULL, false };
+
+static inline int
+tint_cache_slot( uint64_t key )
+{
+  uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+  return (int) ( hash >> ( 64 - TINT_CACHE_BITS ) );
+}
+
+/* Allocate COUNT caches, one per thread tinting dabs. */
+
+static void
+alloc_tint_caches( int count )
+{
+  tint_caches.caches = (tint_cache*) malloc( count * sizeof( tint_cache ) );
+  if ( !tint_caches.caches )
   {
-    return;
+    fprintf( stderr, "Not enough memory for the tint caches.\n" );
+    exit( 1 );
   }
-  if ( ButtonDown )
+  tint_caches.count = count;
+  tint_caches.valid = false;
+  for ( int nn = 0; nn < count; ++nn )
   {
-    if ( SAMPLE == brush_selection )
-    {
-      visual_canvas_color = PIXEL( canvas, XX, YY );
-      display_brush();
-    }
-    else
-    {
-      apply_brush( XX, YY );
-    }
+    tint_caches.caches[nn].hits = 0;
+    tint_caches.caches[nn].misses = 0;
+    tint_caches.caches[nn].bypassed = 0;
   }
+}
 
-  if ( is_dark_canvas( X0, Y0, X1, Y1, canvas ) )
-  {
-    cursor_color = BRIGHT_CURSOR;
-  }
-  else
+/* Forget the cached pixels, e.g. at the start of a stroke. */
+
+static void
+reset_tint_caches()
+{
+  tint_caches.valid = false;
+}
+
+/* Make the caches valid for tinting with BRUSH.  Return the caches, or NULL
+   if caching is disabled. */
+
+static tint_cache*
+prepare_tint_caches( const tint_brush* brush )
+{
+  if ( !tint_caches.enabled || !tint_caches.caches )
   {
-    cursor_color = DARK_CURSOR;
+    return NULL;
   }
-  for ( int ii = i0, xx = X0; ii < i1; ++ii, ++xx )
+  if ( !tint_caches.valid || memcmp( brush, &tint_caches.brush, sizeof( tint_brush ) ) )
   {
-    for( int jj = j0, yy = Y0; jj < j1; ++jj, ++yy )
+    for ( int nn = 0; nn < tint_caches.count; ++nn )
     {
-      float alpha = 0.2 * compute_alpha( ii, jj );
-      if ( alpha_range->left < alpha && alpha < alpha_range->right )
+      tint_cache* cache = &tint_caches.caches[nn];
+      for ( int ii = 0; ii < TINT_CACHE_SIZE; ++ii )
       {
-        if ( xx < canvas->Width && yy < canvas->Height && 0 <= xx && 0 <= yy)
-        {
-          struct pixbuf* pb = &canvas_pixel[++saved_pixels];
-          pb->xx = xx;
-          pb->yy = yy;
-          pb->pixel = PIXEL( canvas, xx, yy );
-          PIXEL( canvas, xx, yy ) = cursor_color;
-        }
-        else
-        {
-          DOUT(( "cursor (%d, %d)\n", xx, yy ));
-        }
+        cache->key[ii] = TINT_CACHE_EMPTY;
       }
+      cache->probe = 0;
+      cache->probe_hits = 0;
+      cache->bypass = 0;
     }
+    tint_caches.min_hits = ( tint_row == tint_row_scalar ) ? 10 : 70;
+    tint_caches.brush = *brush;
+    tint_caches.valid = true;
   }
-  PX0 = X0;
-  PX1 = X1 - 1;
-  PY0 = Y0;
-  PY1 = Y1 - 1;
-  UpdateCanvas( canvas, X0, X1 - 1, Y0, Y1 - 1 );
+  return tint_caches.caches;
 }
 
+/* Total hits, misses and bypassed pixels of the caches since the last
+   call. */
+
+static void
+take_tint_cache_counts( long* hits, long* misses, long* bypassed )
+{
+  *hits = *misses = *bypassed = 0;
+  for ( int nn = 0; nn < tint_caches.count; ++nn )
+  {
+    tint_cache* cache = &tint_caches.caches[nn];
+    *hits += cache->hits;
+    *misses += cache->misses;
+    *bypassed += cache->bypassed;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->bypassed = 0;
+  }
+}
+
+/* Tint a row like tint_row(), looking the pixels up in CACHE first.  COUNT
+   does not exceed MAX_BRUSH_SIZE. */
+
+static void
+tint_row_cached( tint_cache* cache, CanvasPixel* row, const float* alpha, int count,
+                 const tint_brush* brush )
+{
+  CanvasPixel miss_pixel[MAX_BRUSH_SIZE];
+  float miss_alpha[MAX_BRUSH_SIZE];
+  int miss_at[MAX_BRUSH_SIZE];
+  uint64_t miss_key[MAX_BRUSH_SIZE];
+  int misses = 0;
+
+  for ( int ii = 0; ii < count; ++ii )
+  {
+    uint32_t weight;
+    memcpy( &weight, &alpha[ii], sizeof( weight ) );
+    uint64_t key = ( (uint64_t) (uint32_t) row[ii] << 32 ) | weight;
+    int slot = tint_cache_slot( key );
+    if ( cache->key[slot] == key )
+    {
+      row[ii] = cache->value[slot];
+      continue;
+    }
+    miss_pixel[misses] = row[ii];
+    miss_alpha[misses] = alpha[ii];
+    miss_at[misses] = ii;
+    miss_key[misses] = key;
+    ++misses;
+  }
+  cache->hits += count - misses;
+  cache->misses += misses;
+  cache->probe += count;
+  cache->probe_hits += count - misses;
+  if ( cache->probe >= TINT_CACHE_PROBE )
+  {
+    if ( cache->probe_hits * 100 < cache->probe * tint_caches.min_hits )
+    {
+      cache->bypass = TINT_CACHE_BYPASS;
+    }
+    cache->probe = 0;
+    cache->probe_hits = 0;
+  }
+  if ( !misses )
+  {
+    return;
+  }
+
+  tint_row( miss_pixel, miss_alpha, misses, brush );
+  for ( int mm = 0; mm < misses; ++mm )
+  {
+    int slot = tint_cache_slot( miss_key[mm] );
+    cache->key[slot] = miss_key[mm];
+    cache->value[slot] = miss_pixel[mm];
+    row[miss_at[mm]] = miss_pixel[mm];
+  }
+}
+
+/* A band of rows of a dab to tint: the canvas rows Y0 + from .. Y0 + to - 1,
+   columns [X0, X1), tinted with the weights of the mask rows j0 + from ..
+   j0 + to - 1 starting at column i0. */
+
+typedef struct {
+  Canvas* canvas;
+  int X0;
+  int X1;
+  int Y0;
+  int i0;
+  int j0;
+  int rows;
+  tint_brush brush;
+  tint_cache* caches;
+} tint_job;
+
+/* Tint the rows FROM .. TO - 1 of JOB with the cache of the thread BAND. */
+
+static void
+tint_band( const tint_job* job, int band, int from, int to )
+{
+  tint_cache* cache = job->caches ? &job->caches[band] : NULL;
+  for ( int kk = from; kk < to; ++kk )
+  {
+    CanvasSpan span = CanvasRowSpan( job->canvas, job->X0, job->X1 - 1, job->Y0 + kk );
+    const float* alpha = &MASK_WEIGHT( job->i0, job->j0 + kk );
+    if ( cache && cache->bypass )
+    {
+      --cache->bypass;
+      cache->bypassed += span.Length;
+      tint_row( span.Pixels, alpha, span.Length, &job->brush );
+    }
+    else if ( cache )
+    {
+      tint_row_cached( cache, span.Pixels, alpha, span.Length, &job->brush );
+    }
+    else
+    {
+      tint_row( span.Pixels, alpha, span.Length, &job->brush );
+    }
+  }
+}
+
+/* The tinting worker pool.  A dab that covers at least tint_pool.threshold
+   pixels is split into bands of consecutive rows, one band per worker plus
+   one for the calling thread.  Every row is tinted by the same kernel with
+   the same weights as in serial execution, and no row depends on another, so
+   the result does not depend on the number of threads.  The workers are
+   started once by start_tint_pool() and sleep between two dabs, so strokes
+   do not pay for starting threads. */
+
+static struct {
+  int workers;
+  int threshold;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  unsigned long generation;
+  int busy;
+  tint_job job;
+} tint_pool = { 0, 128 * 128, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                PTHREAD_COND_INITIALIZER, 0, 0 };
+
+static void
+tint_pool_band( int band, const tint_job* job )
+{
+  int bands = tint_pool.workers + 1;
+  tint_band( job, band, job->rows * band / bands, job->rows * ( band + 1 ) / bands );
+}
+
+static void*
+tint_worker( void* arg )
+{
+  int band = (int) (intptr_t) arg;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock( &tint_pool.lock );
+  for ( ;; )
+  {
+    while ( seen == tint_pool.generation )
+    {
+      pthread_cond_wait( &tint_pool.start, &tint_pool.lock );
+    }
+    seen = tint_pool.generation;
+    tint_job job = tint_pool.job;
+    pthread_mutex_unlock( &tint_pool.lock );
+
+    tint_pool_band( band, &job );
+
+    pthread_mutex_lock( &tint_pool.lock );
+    if ( 0 == --tint_pool.busy )
+    {
+      pthread_cond_signal( &tint_pool.done );
+    }
+  }
+  return NULL;
+}
+
+/* Start THREADS - 1 workers, so that large dabs are tinted by THREADS
+   threads including the calling one.  Return the number of threads actually
+   available, which is less than THREADS if a worker could not be started. */
+
+static int
+start_tint_pool( int threads )
+{
+  while ( tint_pool.workers + 1 < threads )
+  {
+    pthread_t thread;
+    if ( pthread_create( &thread, NULL, tint_worker, (void*) (intptr_t) tint_pool.workers ) )
+    {
+      break;
+    }
+    pthread_detach( thread );
+    ++tint_pool.workers;
+  }
+  alloc_tint_caches( tint_pool.workers + 1 );
+  return tint_pool.workers + 1;
+}
+
+/* Tint the dab described by JOB, on the worker pool if it is large enough. */
+
+static void
+tint_dab( const tint_job* job )
+{
+  if ( !tint_pool.workers || ( job->X1 - job->X0 ) * job->rows < tint_pool.threshold )
+  {
+    tint_band( job, tint_pool.workers, 0, job->rows );
+    return;
+  }
+  pthread_mutex_lock( &tint_pool.lock );
+  tint_pool.job = *job;
+  tint_pool.busy = tint_pool.workers;
+  ++tint_pool.generation;
+  pthread_cond_broadcast( &tint_pool.start );
+  pthread_mutex_unlock( &tint_pool.lock );
+
+  tint_pool_band( tint_pool.workers, job );
+
+  pthread_mutex_lock( &tint_pool.lock );
+  while ( tint_pool.busy )
+  {
+    pthread_cond_wait( &tint_pool.done, &tint_pool.lock );
+  }
+  pthread_mutex_unlock( &tint_pool.lock );
+}
+
+/* Set up BRUSH to tint the COMPONENT of pixels toward the color RR, GG, BB,
+   with the hue HUE in degrees if the color is neutral. */
+
+static void
+init_tint_brush( tint_brush* brush, int rr, int gg, int bb, float hue, int component )
+{
+  brush->hue = hue;
+  rgb2hsv( rr / 255.0, gg / 255.0, bb / 255.0, &brush->hue, &brush->sat, &brush->val );
+  brush->component = component;
+  brush->fixed.hue = (int) ( hue * HSV_ONE / 60.0 + 0.5 ) % HSV_HUE_FULL;
+  brush->fixed.sat = 0;
+  brush->fixed.val = 0;
+  rgb2hsv_fixed( rr, gg, bb, &brush->fixed );
+}
+
+static void
+tinting( int OX, int OY, int X0, int Y0, int X1, int Y1, Canvas* canvas )
+{
+  int I0 = OX - brush_width / 2;
+  int J0 = OY - brush_height / 2;
+  int i0 = X0 - I0;
+  int i1 = X1 - I0;
+  int j0 = Y0 - J0;
+  int j1 = Y1 - J0;
+
+  if ( i0 >= i1 || j0 >= j1 )
+  {
+    DOUT(( "BRUSH AREA (%d,%d) (%d,%d)\n", i0, j0, i1, j1 ));
+    DOUT(( "OX, OY (%d,%d) X0, Y0 : (%d,%d) X1, Y1 : (%d,%d)\n",
+           OX, OY, X0, Y0, X1, Y1 ));
+    return;
+  }
+
+  tint_job job = { canvas, X0, X1, Y0, i0, j0, j1 - j0,
+                   { 0.0, 0.0, 0.0, 0, { 0, 0, 0 } }, NULL };
+  init_tint_brush( &job.brush, Rcomponent, Gcomponent, Bcomponent, Hcomponent, brush_component );
+  job.caches = prepare_tint_caches( &job.brush );
+  tint_dab( &job );
+} // tinting
+
+
+/* Statistics of the image canvas for the cursor.  is_dark_canvas() needs
+   the average hue and value of the pixels under the cursor on every move of
+   the pointer.  The canvas is divided into tiles of STATS_TILE x STATS_TILE
+   pixels, and for every tile the table keeps the sums of the fixed-point
+   value and hue of its pixels.  Over those it keeps a summed-area table, in
+   which entry (tx, ty) is the sum over the tiles above and to the left of
+   tile (tx, ty), so the sum over any rectangle of whole tiles takes four
+   lookups.  A rectangle that covers tiles only in part counts each of them
+   in proportion to the area it covers, which is interpolating the table
+   bilinearly within the tile; the cursor color is only a guess anyway.
+
+   Dabs mark the tiles they change as dirty and make the rows of the table
+   below them stale, loads and fills invalidate everything.  Dirty tiles are
+   summed again, and stale rows of the table rebuilt, only as far down as a
+   lookup needs them. */
+
+#define STATS_TILE_SHIFT 5
+#define STATS_TILE ( 1 << STATS_TILE_SHIFT )
+
+static struct {
+  CanvasPixel* pixels;
+  int width;
+  int height;
+  int tiles_x;
+  int tiles_y;
+  bool* dirty;
+  uint32_t* val;
+  uint32_t* hue;
+  int table_rows;
+  long long* table_val;
+  long long* table_hue;
+} canvas_stats = { NULL, 0, 0, 0, 0, NULL, NULL, NULL, 0, NULL, NULL };
+
+static void
+invalidate_canvas_stats()
+{
+  canvas_stats.pixels = NULL;
+}
+
+/* Mark the tiles overlapping [X0, X1) x [Y0, Y1) as dirty. */
+
+static void
+mark_canvas_stats( int X0, int Y0, int X1, int Y1 )
+{
+  if ( !canvas_stats.pixels )
+    return;
+  for ( int ty = Y0 >> STATS_TILE_SHIFT; ty <= ( Y1 - 1 ) >> STATS_TILE_SHIFT; ++ty )
+  {
+    for ( int tx = X0 >> STATS_TILE_SHIFT; tx <= ( X1 - 1 ) >> STATS_TILE_SHIFT; ++tx )
+    {
+      canvas_stats.dirty[ (size_t) ty * canvas_stats.tiles_x + tx ] = true;
+    }
+  }
+  // row ty + 1 of the table is the first one to include tile row ty.
+  canvas_stats.table_rows = MIN( canvas_stats.table_rows, ( Y0 >> STATS_TILE_SHIFT ) + 1 );
+}
+
+/* Make the statistics describe CANVAS, with all tiles dirty if they were
+   invalidated or built for another canvas. */
+
+static void
+prepare_canvas_stats( Canvas* canvas )
+{
+  if ( canvas_stats.pixels == canvas->Pixels && canvas_stats.width == canvas->Width
+       && canvas_stats.height == canvas->Height )
+  {
+    return;
+  }
+  int tiles_x = ( canvas->Width + STATS_TILE - 1 ) >> STATS_TILE_SHIFT;
+  int tiles_y = ( canvas->Height + STATS_TILE - 1 ) >> STATS_TILE_SHIFT;
+  if ( canvas_stats.tiles_x != tiles_x || canvas_stats.tiles_y != tiles_y || !canvas_stats.dirty )
+  {
+    size_t tiles = (size_t) tiles_x * tiles_y;
+    size_t table = (size_t) ( tiles_x + 1 ) * ( tiles_y + 1 );
+    free( canvas_stats.dirty );
+    free( canvas_stats.val );
+    free( canvas_stats.hue );
+    free( canvas_stats.table_val );
+    free( canvas_stats.table_hue );
+    canvas_stats.dirty = (bool*) malloc( tiles * sizeof( bool ) );
+    canvas_stats.val = (uint32_t*) malloc( tiles * sizeof( uint32_t ) );
+    canvas_stats.hue = (uint32_t*) malloc( tiles * sizeof( uint32_t ) );
+    canvas_stats.table_val = (long long*) calloc( table, sizeof( long long ) );
+    canvas_stats.table_hue = (long long*) calloc( table, sizeof( long long ) );
+    if ( !canvas_stats.val || !canvas_stats.hue || !canvas_stats.dirty
+         || !canvas_stats.table_val || !canvas_stats.table_hue )
+    {
+      fprintf( stderr, "Not enough memory for the canvas statistics.\n" );
+      exit( 1 );
+    }
+  }
+  canvas_stats.width = canvas->Width;
+  canvas_stats.height = canvas->Height;
+  canvas_stats.tiles_x = tiles_x;
+  canvas_stats.tiles_y = tiles_y;
+  for ( size_t tt = 0; tt < (size_t) tiles_x * tiles_y; ++tt )
+  {
+    canvas_stats.dirty[tt] = true;
+  }
+  // row 0 of the table, the empty sums, is never stale.
+  canvas_stats.table_rows = 1;
+  canvas_stats.pixels = canvas->Pixels;
+}
+
+/* Sum the value and the hue of the pixels of tile (TX, TY) of CANVAS into
+   the table of tiles. */
+
+static void
+sum_stats_tile( Canvas* canvas, int TX, int TY )
+{
+  int x0 = TX << STATS_TILE_SHIFT;
+  int y0 = TY << STATS_TILE_SHIFT;
+  int x1 = MIN( x0 + STATS_TILE, canvas->Width );
+  int y1 = MIN( y0 + STATS_TILE, canvas->Height );
+  uint32_t val = 0;
+  uint32_t hue = 0;
+  for ( int yy = y0; yy < y1; ++yy )
+  {
+    const CanvasPixel* row = CANVAS_ROW( canvas, yy );
+    for ( int xx = x0; xx < x1; ++xx )
+    {
+      fixed_hsv hsv = { 0, 0, 0 };
+      rgb2hsv_fixed( GET_RED( row[xx] ), GET_GREEN( row[xx] ), GET_BLUE( row[xx] ), &hsv );
+      val += hsv.val;
+      hue += hsv.hue;
+    }
+  }
+  size_t tt = (size_t) TY * canvas_stats.tiles_x + TX;
+  canvas_stats.val[tt] = val;
+  canvas_stats.hue[tt] = hue;
+  canvas_stats.dirty[tt] = false;
+}
+
+/* Bring the first ROWS rows of the summed-area table up to date. */
+
+static void
+update_stats_table( Canvas* canvas, int rows )
+{
+  int stride = canvas_stats.tiles_x + 1;
+  for ( int rr = canvas_stats.table_rows; rr < rows; ++rr )
+  {
+    int ty = rr - 1;
+    long long* above_val = &canvas_stats.table_val[ (size_t) ty * stride ];
+    long long* above_hue = &canvas_stats.table_hue[ (size_t) ty * stride ];
+    long long* row_val = above_val + stride;
+    long long* row_hue = above_hue + stride;
+    long long val = 0;
+    long long hue = 0;
+    for ( int tx = 0; tx < canvas_stats.tiles_x; ++tx )
+    {
+      size_t tt = (size_t) ty * canvas_stats.tiles_x + tx;
+      if ( canvas_stats.dirty[tt] )
+      {
+        sum_stats_tile( canvas, tx, ty );
+      }
+      val += canvas_stats.val[tt];
+      hue += canvas_stats.hue[tt];
+      row_val[ tx + 1 ] = above_val[ tx + 1 ] + val;
+      row_hue[ tx + 1 ] = above_hue[ tx + 1 ] + hue;
+    }
+  }
+  canvas_stats.table_rows = MAX( canvas_stats.table_rows, rows );
+}
+
+/* Find the tile TT along an axis of LENGTH pixels that holds pixel boundary
+   POS and the fraction FF of the tile that lies before POS.  The last
+   boundary, LENGTH itself, ends the last tile. */
+
+static void
+locate_stats_tile( int POS, int LENGTH, int* TT, double* FF )
+{
+  int tt = MIN( POS, LENGTH - 1 ) >> STATS_TILE_SHIFT;
+  int t0 = tt << STATS_TILE_SHIFT;
+  *TT = tt;
+  *FF = (double) ( POS - t0 ) / ( MIN( t0 + STATS_TILE, LENGTH ) - t0 );
+}
+
+/* Sum the value and the hue of CANVAS in [0, X) x [0, Y), interpolating
+   the summed-area table within the tile that holds the corner. */
+
+static void
+corner_canvas_stats( int X, int Y, double* val, double* hue )
+{
+  int tx;
+  int ty;
+  double fx;
+  double fy;
+  locate_stats_tile( X, canvas_stats.width, &tx, &fx );
+  locate_stats_tile( Y, canvas_stats.height, &ty, &fy );
+  int stride = canvas_stats.tiles_x + 1;
+  size_t t00 = (size_t) ty * stride + tx;
+  size_t t10 = t00 + stride;
+  double w00 = ( 1 - fx ) * ( 1 - fy );
+  double w01 = fx * ( 1 - fy );
+  double w10 = ( 1 - fx ) * fy;
+  double w11 = fx * fy;
+  const long long* tv = canvas_stats.table_val;
+  const long long* th = canvas_stats.table_hue;
+  *val = w00 * tv[t00] + w01 * tv[ t00 + 1 ] + w10 * tv[t10] + w11 * tv[ t10 + 1 ];
+  *hue = w00 * th[t00] + w01 * th[ t00 + 1 ] + w10 * th[t10] + w11 * th[ t10 + 1 ];
+}
+
+/* Estimate the sums of the value and the hue of the pixels of CANVAS in
+   [X0, X1) x [Y0, Y1), which must lie within the canvas.  The sums are
+   exact for rectangles of whole tiles. */
+
+static void
+sum_canvas_stats( Canvas* canvas, int X0, int Y0, int X1, int Y1,
+                  double* val, double* hue )
+{
+  prepare_canvas_stats( canvas );
+  update_stats_table( canvas, ( MIN( Y1, canvas->Height - 1 ) >> STATS_TILE_SHIFT ) + 2 );
+  double v00, v01, v10, v11;
+  double h00, h01, h10, h11;
+  corner_canvas_stats( X0, Y0, &v00, &h00 );
+  corner_canvas_stats( X1, Y0, &v01, &h01 );
+  corner_canvas_stats( X0, Y1, &v10, &h10 );
+  corner_canvas_stats( X1, Y1, &v11, &h11 );
+  *val = v11 - v10 - v01 + v00;
+  *hue = h11 - h10 - h01 + h00;
+}
+
+/* Undo history of the image canvas.  A history record holds the tiles of
+   HISTORY_TILE x HISTORY_TILE pixels that one stroke, or one Fill, changed.
+   A tile is copied into the record the first time the stroke is about to
+   change it, so a record costs memory and time in proportion to the area
+   the stroke touched, not to the size of the image.  Undoing a record
+   exchanges the tiles it holds with the tiles of the canvas, and redoing it
+   exchanges them back.  Records past the undone one are dropped when a new
+   stroke starts, and the oldest records are dropped when the history takes
+   more than history.budget bytes.  Loading and resetting the canvas clear
+   the history. */
+
+#define HISTORY_TILE_SHIFT 6
+#define HISTORY_TILE ( 1 << HISTORY_TILE_SHIFT )
+
+typedef struct {
+  int tx;
+  int ty;
+  CanvasPixel* pixels;
+} history_tile;
+
+typedef struct {
+  int count;
+  int size;
+  history_tile* tiles;
+  long bytes;
+} history_record;
+
+static struct {
+  long budget;
+  long bytes;
+  int count;            // records
+  int done;             // records[0 .. done) can be undone, the rest redone
+  int size;
+  history_record** records;
+  history_record* open; // record of the stroke in progress
+  int width;            // canvas the saved flags were made for
+  int height;
+  int tiles_x;
+  bool* saved;          // tiles of the canvas saved in the open record
+} history = { 128L << 20, 0, 0, 0, 0, NULL, NULL, 0, 0, 0, NULL };
+
+static void
+free_history_record( history_record* record )
+{
+  for ( int nn = 0; nn < record->count; ++nn )
+  {
+    free( record->tiles[nn].pixels );
+  }
+  history.bytes -= record->bytes;
+  free( record->tiles );
+  free( record );
+}
+
+/* Drop the records from FROM on. */
+
+static void
+drop_history_records( int from )
+{
+  for ( int nn = from; nn < history.count; ++nn )
+  {
+    free_history_record( history.records[nn] );
+  }
+  history.count = from;
+  history.done = MIN( history.done, from );
+}
+
+/* Drop the oldest records until the history fits in its budget, keeping the
+   latest record at least. */
+
+static void
+trim_history()
+{
+  int drop = 0;
+  long bytes = history.bytes;
+  while ( bytes > history.budget && drop < history.count - 1 )
+  {
+    bytes -= history.records[drop]->bytes;
+    free_history_record( history.records[drop] );
+    ++drop;
+  }
+  if ( drop )
+  {
+    memmove( history.records, history.records + drop,
+             ( history.count - drop ) * sizeof( history_record* ) );
+    history.count -= drop;
+    history.done -= drop;
+  }
+}
+
+static void
+clear_history()
+{
+  end_history_record();
+  drop_history_records( 0 );
+}
+
+/* Exchange the pixels of TILE with those of the canvas. */
+
+static void
+swap_history_tile( Canvas* canvas, history_tile* tile, bool copy_only )
+{
+  int X0 = tile->tx << HISTORY_TILE_SHIFT;
+  int Y0 = tile->ty << HISTORY_TILE_SHIFT;
+  int width = MIN( HISTORY_TILE, canvas->Width - X0 );
+  int height = MIN( HISTORY_TILE, canvas->Height - Y0 );
+  CanvasPixel* saved = tile->pixels;
+  for ( int yy = Y0; yy < Y0 + height; ++yy, saved += width )
+  {
+    CanvasPixel* row = CANVAS_ROW( canvas, yy ) + X0;
+    if ( copy_only )
+    {
+      memcpy( saved, row, width * sizeof( CanvasPixel ) );
+      continue;
+    }
+    for ( int xx = 0; xx < width; ++xx )
+    {
+      CanvasPixel pixel = row[xx];
+      row[xx] = saved[xx];
+      saved[xx] = pixel;
+    }
+  }
+}
+
+/* Start a record for the changes of a new stroke. */
+
+static void
+begin_history_record()
+{
+  Canvas* canvas = &Canvases[0];
+  end_history_record();
+  if ( history.width != canvas->Width || history.height != canvas->Height )
+  {
+    drop_history_records( 0 );
+    free( history.saved );
+    history.width = canvas->Width;
+    history.height = canvas->Height;
+    history.tiles_x = ( canvas->Width + HISTORY_TILE - 1 ) >> HISTORY_TILE_SHIFT;
+    int tiles_y = ( canvas->Height + HISTORY_TILE - 1 ) >> HISTORY_TILE_SHIFT;
+    history.saved = (bool*) calloc( (size_t) history.tiles_x * tiles_y, sizeof( bool ) );
+    if ( !history.saved )
+    {
+      fprintf( stderr, "Not enough memory for the undo history.\n" );
+      exit( 1 );
+    }
+  }
+  history.open = (history_record*) calloc( 1, sizeof( history_record ) );
+  if ( !history.open )
+  {
+    fprintf( stderr, "Not enough memory for the undo history.\n" );
+    exit( 1 );
+  }
+}
+
+/* Save into the open record the tiles overlapping [X0, X1) x [Y0, Y1) that
+   it does not hold yet.  Called before the pixels change. */
+
+static void
+save_history_tiles( int X0, int Y0, int X1, int Y1 )
+{
+  history_record* record = history.open;
+  if ( !record )
+    return;
+  Canvas* canvas = &Canvases[0];
+  for ( int ty = Y0 >> HISTORY_TILE_SHIFT; ty <= ( Y1 - 1 ) >> HISTORY_TILE_SHIFT; ++ty )
+  {
+    for ( int tx = X0 >> HISTORY_TILE_SHIFT; tx <= ( X1 - 1 ) >> HISTORY_TILE_SHIFT; ++tx )
+    {
+      bool* saved = &history.saved[ (size_t) ty * history.tiles_x + tx ];
+      if ( *saved )
+        continue;
+      if ( record->count == record->size )
+      {
+        record->size = MAX( 16, 2 * record->size );
+        record->tiles = (history_tile*) realloc( record->tiles, record->size * sizeof( history_tile ) );
+      }
+      int width = MIN( HISTORY_TILE, canvas->Width - ( tx << HISTORY_TILE_SHIFT ) );
+      int height = MIN( HISTORY_TILE, canvas->Height - ( ty << HISTORY_TILE_SHIFT ) );
+      long bytes = (long) width * height * sizeof( CanvasPixel );
+      history_tile* tile = record->tiles ? &record->tiles[record->count] : NULL;
+      CanvasPixel* pixels = tile ? (CanvasPixel*) malloc( bytes ) : NULL;
+      if ( !pixels )
+      {
+        fprintf( stderr, "Not enough memory for the undo history.\n" );
+        exit( 1 );
+      }
+      tile->tx = tx;
+      tile->ty = ty;
+      tile->pixels = pixels;
+      swap_history_tile( canvas, tile, true );
+      ++record->count;
+      record->bytes += bytes;
+      history.bytes += bytes;
+      *saved = true;
+    }
+  }
+}
+
+/* Close the open record, if any, and add it to the history. */
+
+static void
+end_history_record()
+{
+  history_record* record = history.open;
+  if ( !record )
+    return;
+  history.open = NULL;
+  for ( int nn = 0; nn < record->count; ++nn )
+  {
+    history.saved[ (size_t) record->tiles[nn].ty * history.tiles_x + record->tiles[nn].tx ] = false;
+  }
+  if ( !record->count )
+  {
+    free_history_record( record );
+    return;
+  }
+  drop_history_records( history.done );
+  if ( history.count == history.size )
+  {
+    history.size = MAX( 16, 2 * history.size );
+    history.records = (history_record**) realloc( history.records,
+                                                  history.size * sizeof( history_record* ) );
+    if ( !history.records )
+    {
+      fprintf( stderr, "Not enough memory for the undo history.\n" );
+      exit( 1 );
+    }
+  }
+  history.records[history.count++] = record;
+  history.done = history.count;
+  trim_history();
+}
+
+/* Exchange the tiles of RECORD with the canvas.  The area they cover is
+   returned in [X0, X1) x [Y0, Y1).  The screen is not updated. */
+
+static void
+swap_history_record( history_record* record, int* X0, int* Y0, int* X1, int* Y1 )
+{
+  Canvas* canvas = &Canvases[0];
+  *X0 = canvas->Width;
+  *Y0 = canvas->Height;
+  *X1 = *Y1 = 0;
+  for ( int nn = 0; nn < record->count; ++nn )
+  {
+    history_tile* tile = &record->tiles[nn];
+    swap_history_tile( canvas, tile, false );
+    int x0 = tile->tx << HISTORY_TILE_SHIFT;
+    int y0 = tile->ty << HISTORY_TILE_SHIFT;
+    int x1 = MIN( x0 + HISTORY_TILE, canvas->Width );
+    int y1 = MIN( y0 + HISTORY_TILE, canvas->Height );
+    mark_canvas_stats( x0, y0, x1, y1 );
+    *X0 = MIN( *X0, x0 );
+    *Y0 = MIN( *Y0, y0 );
+    *X1 = MAX( *X1, x1 );
+    *Y1 = MAX( *Y1, y1 );
+  }
+}
+
+/* Undo the latest record, or redo the latest undone one if REDO.  Return
+   false if there is nothing to undo or redo. */
+
+static bool
+step_history( bool redo, int* X0, int* Y0, int* X1, int* Y1 )
+{
+  end_history_record();
+  if ( redo ? history.done == history.count : !history.done )
+    return false;
+  history_record* record = redo ? history.records[history.done++] : history.records[--history.done];
+  swap_history_record( record, X0, Y0, X1, Y1 );
+  return true;
+}
+
+static void
+undo_stroke()
+{
+  int X0, Y0, X1, Y1;
+  if ( step_history( false, &X0, &Y0, &X1, &Y1 ) )
+    UpdateCanvas( &Canvases[0], X0, X1 - 1, Y0, Y1 - 1 );
+}
+
+static void
+redo_stroke()
+{
+  int X0, Y0, X1, Y1;
+  if ( step_history( true, &X0, &Y0, &X1, &Y1 ) )
+    UpdateCanvas( &Canvases[0], X0, X1 - 1, Y0, Y1 - 1 );
+}
+
+/* Counters of the work done by paint_dab().  The stroke replay reports them
+   to measure the throughput of the brushes. */
+
+static long dab_count = 0;
+static long dab_pixels = 0;
+
+/*  Paint one dab of the current brush centered at (X, Y) into the image
+    canvas, clipped to the part of the canvas shown in its window, so a
+    stroke dragged out of a zoomed or panned view does not paint where the
+    user cannot see.  The clipped area of the dab is returned in
+    [X0, X1) x [Y0, Y1).  Return false if nothing of the dab is shown.  The
+    screen is not updated. */
+
+static bool
+paint_dab( int X, int Y, int* X0, int* Y0, int* X1, int* Y1 )
+{
+  if ( SAMPLE == brush_selection )
+    return false;
+
+  *X0 = X - brush_width / 2;
+  *Y0 = Y - brush_height / 2;
+  *X1 = *X0 + brush_width - 1;
+  *Y1 = *Y0 + brush_height - 1;
+  if ( !ClipCanvasView( &Canvases[0], X0, X1, Y0, Y1 ) )
+    return false;
+  ++*X1;
+  ++*Y1;
+
+  save_history_tiles( *X0, *Y0, *X1, *Y1 );
+  if ( TINT == brush_selection && brush_component )
+  {
+    tinting( X, Y, *X0, *Y0, *X1, *Y1, &Canvases[0] );
+  }
+  else
+  {
+    overpaint( *X0, *Y0, *X1, *Y1, &Canvases[0] );
+  }
+  mark_canvas_stats( *X0, *Y0, *X1, *Y1 );
+  ++dab_count;
+  dab_pixels += ( *X1 - *X0 ) * ( *Y1 - *Y0 );
+  return true;
+}
+
+/*  A stroke is the path of the pointer from the moment the button is pressed
+    until it is released.  The pointer reports only a few positions along the
+    path, so dabs are placed along the segment between consecutive positions,
+    dab_spacing percent of the brush size apart.  The distance covered since
+    the last dab is carried over to the next segment, so the spacing stays
+    even regardless of how the positions are sampled. */
+
+static struct {
+  bool active;
+  float xx;
+  float yy;
+  float covered;
+} stroke = { false, 0.0, 0.0, 0.0 };
+
+/*  Paint the dabs of the stroke up to (X, Y), starting a new stroke with a
+    single dab at (X, Y) if none is in progress.  The bounding box of the
+    painted dabs is returned in [X0, X1) x [Y0, Y1).  Return false if no dab
+    was painted.  The screen is not updated. */
+
+static bool
+stroke_to( int X, int Y, int* X0, int* Y0, int* X1, int* Y1 )
+{
+  if ( !stroke.active )
+  {
+    stroke.active = true;
+    reset_tint_caches();
+    begin_history_record();
+    stroke.xx = X;
+    stroke.yy = Y;
+    stroke.covered = 0.0;
+    return paint_dab( X, Y, X0, Y0, X1, Y1 );
+  }
+
+  float dx = X - stroke.xx;
+  float dy = Y - stroke.yy;
+  float length = sqrt( dx * dx + dy * dy );
+  float step = MAX( 1.0, dab_spacing * MAX( brush_width, brush_height ) / 100.0 );
+  bool painted = false;
+
+  /* Let the pages under the segment be read in while the first dabs are
+     painted, in case the canvas is kept in a file. */
+
+  if ( step - stroke.covered <= length )
+  {
+    PrefetchCanvasRect( &Canvases[0],
+                        MIN( stroke.xx, X ) - brush_width, MAX( stroke.xx, X ) + brush_width,
+                        MIN( stroke.yy, Y ) - brush_height, MAX( stroke.yy, Y ) + brush_height );
+  }
+
+  *X0 = *Y0 = *X1 = *Y1 = 0;
+  float distance = step - stroke.covered;
+  for ( ; distance <= length; distance += step )
+  {
+    int xx = (int) floor( stroke.xx + dx * distance / length + 0.5 );
+    int yy = (int) floor( stroke.yy + dy * distance / length + 0.5 );
+    int x0, y0, x1, y1;
+    if ( paint_dab( xx, yy, &x0, &y0, &x1, &y1 ) )
+    {
+      *X0 = painted ? MIN( *X0, x0 ) : x0;
+      *Y0 = painted ? MIN( *Y0, y0 ) : y0;
+      *X1 = painted ? MAX( *X1, x1 ) : x1;
+      *Y1 = painted ? MAX( *Y1, y1 ) : y1;
+      painted = true;
+    }
+  }
+  stroke.covered = length - ( distance - step );
+  stroke.xx = X;
+  stroke.yy = Y;
+  return painted;
+}
+
+static void
+end_stroke()
+{
+  if ( stroke.active )
+  {
+    end_history_record();
+  }
+  stroke.active = false;
+}
+
+/*  Actually apply the brush to the canvas: extend the stroke to (X, Y) and
+    update the screen once for all the dabs it took. */
+
+static void
+apply_stroke( int X, int Y )
+{
+  int X0, Y0, X1, Y1;
+  if ( !stroke_to( X, Y, &X0, &Y0, &X1, &Y1 ) )
+    return;
+
+  /*     DOUT(( "UPDATE (%d, %d) x (%d, %d)\n", X0, Y0, X1 - 1, Y1 - 1 )); */
+
+  UpdateCanvas( &Canvases[0], X0, X1 - 1, Y0, Y1 - 1 );
+} // apply_stroke
+
+/* The visualization canvas shows its background color everywhere except in
+   the rectangles where the images of the brush were drawn last time, so a new
+   visualization only clears those and draws the new ones.  The whole canvas
+   is refilled only when the background color changes.  Rectangles are
+   [x0, x1) x [y0, y1); the ones changed wait in damage until display_brush()
+   updates them on the screen.  That is room for the two cleared and the two
+   drawn rectangles of one visualization; if more pile up before they are
+   displayed, the whole canvas becomes the damage instead. */
+
+#define VISUAL_DAMAGE_MAX 4
+
+typedef struct {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+} visual_rect;
+
+static struct {
+  bool filled;
+  CanvasPixel color;
+  int drawn_count;
+  visual_rect drawn[2];
+  int damage_count;
+  visual_rect damage[VISUAL_DAMAGE_MAX];
+} visual = { false, 0, 0, { { 0, 0, 0, 0 } }, 0, { { 0, 0, 0, 0 } } };
+
+static void
+add_visual_damage( int X0, int Y0, int X1, int Y1 )
+{
+  if ( visual.damage_count == VISUAL_DAMAGE_MAX )
+  {
+    visual_rect whole = { 0, 0, Canvases[1].Width, Canvases[1].Height };
+    visual.damage[0] = whole;
+    visual.damage_count = 1;
+    return;
+  }
+  if ( visual.damage_count == 1 && visual.damage[0].x0 == 0 && visual.damage[0].y0 == 0
+       && visual.damage[0].x1 == Canvases[1].Width && visual.damage[0].y1 == Canvases[1].Height )
+  {
+    return;
+  }
+  visual_rect rect = { X0, Y0, X1, Y1 };
+  visual.damage[visual.damage_count++] = rect;
+}
+
+/* Copy the image of the brush from brush_pixels to CANVAS, magnified MAGNIF
+   times, with its top left corner at (X0, Y0).  The copy is clipped to the
+   canvas.  Only the first row of each magnified row of the brush is built
+   pixel by pixel; the other rows are copies of it.  The rectangle is
+   remembered to be cleared by the next visualization. */
+
+static void
+draw_brush_pixels( Canvas* canvas, int X0, int Y0, int magnif )
+{
+  int x0 = X0;
+  int y0 = Y0;
+  int x1 = X0 + magnif * brush_width - 1;
+  int y1 = Y0 + magnif * brush_height - 1;
+  if ( !ClipCanvasRect( canvas, &x0, &x1, &y0, &y1 ) )
+    return;
+
+  for ( int yy = y0; yy <= y1; ++yy )
+  {
+    CanvasPixel* row = CANVAS_ROW( canvas, yy );
+    if ( yy > y0 && ( yy - Y0 ) % magnif )
+    {
+      memcpy( &row[x0], &row[x0 - canvas->Width],
+              ( x1 - x0 + 1 ) * sizeof( CanvasPixel ) );
+      continue;
+    }
+    const CanvasPixel* brush_pixel = &brush_pixels[ ( yy - Y0 ) / magnif ][ ( x0 - X0 ) / magnif ];
+    int repeat = magnif - ( x0 - X0 ) % magnif;
+    for ( int xx = x0; xx <= x1; ++xx )
+    {
+      row[xx] = *brush_pixel;
+      if ( !--repeat )
+      {
+        ++brush_pixel;
+        repeat = magnif;
+      }
+    }
+  }
+  visual_rect rect = { x0, y0, x1 + 1, y1 + 1 };
+  visual.drawn[visual.drawn_count++] = rect;
+  add_visual_damage( x0, y0, x1 + 1, y1 + 1 );
+}
+
+/* Prepare the image of a brush for visualization.  A large brush is
+   magnified less than brush_magnif, so that it fits in the visualization
+   canvas, and a brush larger than the canvas is clipped.  The brush is tinted
+   in the middle of the canvas, where the magnified image covers it. */
+
+static void
+brush_visualization()
+{
+  Canvas* canvas = &Canvases[1];
+  int OX = canvas->Width / 2;
+  int OY = canvas->Height / 2;
+  int X0 = OX - brush_width / 2;
+  int X1 = X0 + brush_width - 1;
+  int Y0 = OY - brush_height / 2;
+  int Y1 = Y0 + brush_height - 1;
+
+  if ( !visual.filled || visual.color != visual_canvas_color )
+  {
+    init_visual_canvas();
+    visual.filled = true;
+    visual.color = visual_canvas_color;
+    visual.damage_count = 0;
+    add_visual_damage( 0, 0, canvas->Width, canvas->Height );
+  }
+  else
+  {
+    for ( int ii = 0; ii < visual.drawn_count; ++ii )
+    {
+      visual_rect* rect = &visual.drawn[ii];
+      fill_canvas_rect( canvas, rect->x0, rect->y0, rect->x1, rect->y1, visual.color );
+      add_visual_damage( rect->x0, rect->y0, rect->x1, rect->y1 );
+    }
+  }
+  visual.drawn_count = 0;
+
+  if ( !ClipCanvasRect( canvas, &X0, &X1, &Y0, &Y1 ) )
+    return;
+  ++X1;
+  ++Y1;
+
+  if ( TINT == brush_selection && brush_component )
+  {
+    /* to make it look closer to what it may look like on canvas apply the
+       tinting several times. */
+    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
+    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
+    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
+    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
+    tinting( OX, OY, X0, Y0, X1, Y1, canvas );
+  }
+  else
+  {
+    overpaint( X0, Y0, X1, Y1, canvas );
+  }
+
+  int I0 = OX - brush_width / 2;
+  int J0 = OY - brush_height / 2;
+  for ( int yy = Y0; yy < Y1; ++yy )
+  {
+    memcpy( &brush_pixels[yy - J0][X0 - I0], &PIXEL( canvas, X0, yy ),
+            ( X1 - X0 ) * sizeof( CanvasPixel ) );
+  }
+
+  int magnif = MIN( brush_magnif, MIN( canvas->Width / brush_width,
+                                       canvas->Height / brush_height ) );
+  magnif = MAX( magnif, 1 );
+  int bw = magnif * brush_width;
+  int bh = magnif * brush_height;
+  X0 = OX - bw / 2;
+  Y0 = OY - bh / 2;
+
+  /* 1:1 brush in the corner, unless the magnified brush covers the corner */
+  if ( 40 + brush_width <= X0 || 40 + brush_height <= Y0 )
+  {
+    draw_brush_pixels( canvas, 40, 40, 1 );
+  }
+  /* magnified brush */
+  draw_brush_pixels( canvas, X0, Y0, magnif );
+}
+
+/*  Actually update the canvas with the image of a visualized brush. */
+
+static void
+display_brush()
+{
+  // if none of the HUE, SAT or VAL are selected don't redisplay the brush.
+  if ( 0 == brush_component && SAMPLE != brush_selection )
+  {
+    return;
+  }
+  bool restore_sample_mode = false;
+  if ( SAMPLE == brush_selection )
+  {
+    restore_sample_mode = true;
+    brush_selection = visualized_brush;
+  }
+  brush_visualization();
+  for ( int ii = 0; ii < visual.damage_count; ++ii )
+  {
+    visual_rect* rect = &visual.damage[ii];
+    UpdateCanvas( &Canvases[1], rect->x0, rect->x1 - 1, rect->y0, rect->y1 - 1 );
+  }
+  visual.damage_count = 0;
+  if ( restore_sample_mode )
+  {
+    brush_selection = SAMPLE;
+  }
+}
+
+/* A very dumb way to estimate the darkness of the background.  We need this to
+   show the cursor in a bright color when it's over dark part of the canvas.
+   The sums of the hue and the value come from the canvas statistics. */
+
+static bool
+is_dark_canvas( int X0, int Y0, int X1, int Y1, Canvas* canvas )
+{
+  long nn = (long) ( X1 - X0 ) * ( Y1 - Y0 );
+  double val;
+  double hue;
+  sum_canvas_stats( canvas, X0, Y0, X1, Y1, &val, &hue );
+
+  // average hue in degrees and value in 0..1.
+  double hh = 60.0 * hue / nn / HSV_ONE;
+  double vv = val / nn / ( 255 << 8 );
+  if ( (55 < hh && hh < 65 && vv > 0.6) || vv > 0.9 )
+  {
+    return false;
+  }
+  return true;
+}
+
+/*  Draw a custom cursor.  Nothing smart here either. Very straightforward
+    implmenetation.  Possibly paint the brush if the button is down, then show
+    the outline of the brush, see update_cursor_outline(), as the overlay of
+    the canvas in the new location.  The overlay is merged into the image on
+    the screen only, so the canvas pixels under the cursor are never touched
+    and need not be saved and restored. */
+
+static void
+move_cursor( int XX, int YY, unsigned int ButtonDown )
+{
+  CanvasPixel cursor_color = DARK_CURSOR;
+  Canvas* canvas = &Canvases[0];
+
+  int I0 = XX - brush_width / 2;
+  int J0 = YY - brush_height / 2;
+  int X0 = I0;
+  int Y0 = J0;
+  int X1 = I0 + brush_width - 1;
+  int Y1 = J0 + brush_height - 1;
+  bool out_of_screen = !ClipCanvasRect( canvas, &X0, &X1, &Y0, &Y1 );
+  ++X1;
+  ++Y1;
+
+  /* The stroke is extended even when the pointer has left the view, so
+     that it reaches the edge of the view. */
+  if ( ButtonDown && SAMPLE != brush_selection )
+  {
+    apply_stroke( XX, YY );
+  }
+  if ( out_of_screen )
+  {
+    SetCanvasOverlay( canvas, 0, 0, 0, NULL, NULL, cursor_color );
+    return;
+  }
+  if ( ButtonDown && SAMPLE == brush_selection )
+  {
+    visual_canvas_color = PIXEL( canvas, XX, YY );
+    display_brush();
+  }
+
+  if ( is_dark_canvas( X0, Y0, X1, Y1, canvas ) )
+  {
+    cursor_color = BRIGHT_CURSOR;
+  }
+  else
+  {
+    cursor_color = DARK_CURSOR;
+  }
+  SetCanvasOverlay( canvas, I0, J0, cursor_outline.count,
+                    cursor_outline.xx, cursor_outline.yy, cursor_color );
+}
+
+/*****************************************************************************/
+/* STROKE REPLAY                                                             */
+/*****************************************************************************/
+
+/* The brushes can be driven without the user interface from a recorded
+   stroke file.  This is used to measure the throughput of the brushes and to
+   compare the output of the brushes before and after a change.  A stroke
+   file is a text file with one command per line.  Empty lines and lines
+   starting with '#' are ignored.
+
+     mode op|tint          select the overpainting or the tinting brush
+     spacing <p>           distance between dabs in percent of brush size
+     size <w> <h>          width and height of the brush in pixels
+     color <r> <g> <b>     color of the brush, each component in 0..255
+     thickness <t>         thickness of the tinting brush
+     components <hsv>      tinted components, any of the letters h, s and v,
+                           or - for none
+     down <x> <y>          press the button at (x, y)
+     move <x> <y>          move the pointer with the button pressed to (x, y)
+     up                    release the button
+     undo                  undo the latest stroke
+     redo                  redo the latest undone stroke
+
+   The down and move commands paint the stroke through stroke_to(), just
+   like mouse_action() does. */
+
+static bool
+replay_command( const char* line, int lineno )
+{
+  char cmd[16];
+  char arg[16];
+  int aa, bb, cc;
+  float ff;
+
+  if ( 1 != sscanf( line, " %15s", cmd ) || '#' == cmd[0] )
+  {
+    return true;
+  }
+  if ( !strcmp( cmd, "mode" ) && 1 == sscanf( line, "%*s %15s", arg ) )
+  {
+    if ( !strcmp( arg, "op" ) )
+    {
+      brush_selection = OP;
+      return true;
+    }
+    if ( !strcmp( arg, "tint" ) )
+    {
+      brush_selection = TINT;
+      return true;
+    }
+  }
+  else if ( !strcmp( cmd, "size" ) && 2 == sscanf( line, "%*s %d %d", &aa, &bb ) )
+  {
+    if ( 0 < aa && 0 < bb )
+    {
+      brush_width = MIN( aa, MAX_BRUSH_SIZE );
+      brush_height = MIN( bb, MAX_BRUSH_SIZE );
+      update_brush_mask();
+      return true;
+    }
+  }
+  else if ( !strcmp( cmd, "color" ) && 3 == sscanf( line, "%*s %d %d %d", &aa, &bb, &cc ) )
+  {
+    Rcomponent = MIN( MAX( aa, 0 ), 255 );
+    Gcomponent = MIN( MAX( bb, 0 ), 255 );
+    Bcomponent = MIN( MAX( cc, 0 ), 255 );
+    return true;
+  }
+  else if ( !strcmp( cmd, "spacing" ) && 1 == sscanf( line, "%*s %d", &aa ) )
+  {
+    dab_spacing = MIN( MAX( aa, 1 ), 100 );
+    return true;
+  }
+  else if ( !strcmp( cmd, "thickness" ) && 1 == sscanf( line, "%*s %f", &ff ) )
+  {
+    brush_thickness = ff;
+    update_brush_mask();
+    return true;
+  }
+  else if ( !strcmp( cmd, "components" ) && 1 == sscanf( line, "%*s %15s", arg ) )
+  {
+    brush_component = 0;
+    if ( strchr( arg, 'h' ) ) brush_component |= HUE;
+    if ( strchr( arg, 's' ) ) brush_component |= SAT;
+    if ( strchr( arg, 'v' ) ) brush_component |= VAL;
+    return true;
+  }
+  else if ( ( !strcmp( cmd, "down" ) || !strcmp( cmd, "move" ) )
+            && 2 == sscanf( line, "%*s %d %d", &aa, &bb ) )
+  {
+    int X0, Y0, X1, Y1;
+    if ( !strcmp( cmd, "down" ) )
+    {
+      end_stroke();
+    }
+    stroke_to( aa, bb, &X0, &Y0, &X1, &Y1 );
+    return true;
+  }
+  else if ( !strcmp( cmd, "up" ) )
+  {
+    end_stroke();
+    return true;
+  }
+  else if ( !strcmp( cmd, "undo" ) || !strcmp( cmd, "redo" ) )
+  {
+    int X0, Y0, X1, Y1;
+    end_stroke();
+    step_history( !strcmp( cmd, "redo" ), &X0, &Y0, &X1, &Y1 );
+    return true;
+  }
+  fprintf( stderr, "replay: line %d: bad command: %s", lineno, line );
+  return false;
+}
+
+/* Replay the stroke file Strokes over the image loaded from Input RUNS times
+   and save the result of the last run to Output.  Every run starts from the
+   original image and from the initial state of the brush.  Return the exit
+   status of the program. */
+
+static int
+replay_strokes( char* Strokes, char* Input, char* Output, int runs )
+{
+  int   saved_selection = brush_selection;
+  int   saved_component = brush_component;
+  int   saved_width = brush_width;
+  int   saved_height = brush_height;
+  int   saved_color[3] = { Rcomponent, Gcomponent, Bcomponent };
+  float saved_thickness = brush_thickness;
+  int   saved_spacing = dab_spacing;
+
+  for ( int run = 1; run <= runs; ++run )
+  {
+    FILE* input = fopen( Strokes, "r" );
+    if ( !input )
+    {
+      fprintf( stderr, "replay: cannot open %s\n", Strokes );
+      return 1;
+    }
+    invalidate_canvas_stats();
+    if ( !LoadCanvas( Input, &Canvases[0] ) )
+    {
+      fprintf( stderr, "replay: cannot load %s\n", Input );
+      fclose( input );
+      return 1;
+    }
+
+    clear_history();
+    brush_selection = saved_selection;
+    brush_component = saved_component;
+    brush_width = saved_width;
+    brush_height = saved_height;
+    Rcomponent = saved_color[0];
+    Gcomponent = saved_color[1];
+    Bcomponent = saved_color[2];
+    brush_thickness = saved_thickness;
+    dab_spacing = saved_spacing;
+    end_stroke();
+    update_brush_mask();
+    dab_count = 0;
+    dab_pixels = 0;
+    long ignored[3];
+    take_tint_cache_counts( &ignored[0], &ignored[1], &ignored[2] );
+
+    struct timeval start, stop;
+    char line[256];
+    int lineno = 0;
+    bool ok = true;
+    gettimeofday( &start, NULL );
+    while ( ok && fgets( line, sizeof( line ), input ) )
+    {
+      ok = replay_command( line, ++lineno );
+    }
+    gettimeofday( &stop, NULL );
+    fclose( input );
+    if ( !ok )
+    {
+      return 1;
+    }
+
+    double seconds = ( stop.tv_sec - start.tv_sec ) + 1e-6 * ( stop.tv_usec - start.tv_usec );
+    double rate = ( seconds > 0.0 ) ? 1.0 / seconds : 0.0;
+    printf( "run %d: %ld dabs, %ld pixels in %.6f s: %.0f dabs/s, %.0f pixels/s\n",
+            run, dab_count, dab_pixels, seconds, dab_count * rate, dab_pixels * rate );
+    long hits, misses, bypassed;
+    take_tint_cache_counts( &hits, &misses, &bypassed );
+    if ( hits + misses )
+    {
+      printf( "run %d: tint cache %ld hits, %ld misses, %ld bypassed: %.1f%% hits\n",
+              run, hits, misses, bypassed, 100.0 * hits / ( hits + misses ) );
+    }
+
+    if ( run == runs && !SaveCanvas( Output, &Canvases[0] ) )
+    {
+      fprintf( stderr, "replay: cannot save %s\n", Output );
+      return 1;
+    }
+    printf( "run %d: %.1f MB of canvas memory\n", run, LiveCanvasMemory() / 1048576.0 );
+    FreeCanvasMemory( Canvases[0].Pixels );
+    Canvases[0].Pixels = NULL;
+  }
+  return 0;
+}
+
+/* Load each of the Count PPM files in Files RUNS times and report the best
+   time of a load with its throughput in megabytes of the file and megapixels
+   per second.  Return the exit status of the program. */
+
+static int
+bench_load( char** Files, int Count, int runs )
+{
+  for ( int f = 0; f < Count; ++f )
+  {
+    struct stat info;
+    if ( stat( Files[f], &info ) )
+    {
+      fprintf( stderr, "bench-load: cannot open %s\n", Files[f] );
+      return 1;
+    }
+    double best = 0.0;
+    long pixels = 0;
+    for ( int run = 1; run <= runs; ++run )
+    {
+      Canvas canvas;
+      struct timeval start, stop;
+      gettimeofday( &start, NULL );
+      if ( !LoadCanvas( Files[f], &canvas ) )
+      {
+        fprintf( stderr, "bench-load: cannot load %s\n", Files[f] );
+        return 1;
+      }
+      gettimeofday( &stop, NULL );
+      FreeCanvasMemory( canvas.Pixels );
+      pixels = (long) canvas.Width * canvas.Height;
+      double seconds = ( stop.tv_sec - start.tv_sec ) + 1e-6 * ( stop.tv_usec - start.tv_usec );
+      if ( run == 1 || seconds < best )
+      {
+        best = seconds;
+      }
+    }
+    double rate = ( best > 0.0 ) ? 1.0 / best : 0.0;
+    printf( "%s: %ld bytes, %ld pixels in %.6f s: %.1f MB/s, %.1f Mpixels/s\n",
+            Files[f], (long) info.st_size, pixels, best,
+            1e-6 * info.st_size * rate, 1e-6 * pixels * rate );
+  }
+  printf( "%.1f MB of canvas memory live after the loads\n", LiveCanvasMemory() / 1048576.0 );
+  return 0;
+}
+
+/* Check the vector tinting kernels against the scalar one on the Count PPM
+   files in Files.  Every row of each image is tinted by every kernel the
+   processor supports, with a sweep of weights from 0 to 1 and a set of brush
+   colors and component masks, and the results must agree within 1 per color
+   component.  No pixel is exempted.  Return the exit status of the program:
+   1 if a pixel differs by more than 1, or if no pixel was compared at all,
+   which passing would pretend the kernels had been checked. */
+
+static int
+check_kernels( char** Files, int Count )
+{
+  static const int colors[][3] = {
+    { 255, 0, 0 }, { 0x30, 0xc0, 0x60 }, { 0x20, 0x40, 0xf0 }, { 200, 200, 40 }, { 128, 128, 128 }
+  };
+  static const char* kernels[] = { "sse4.1", "avx2" };
+  int status = 0;
+  long checked = 0;
+
+  for ( int f = 0; f < Count; ++f )
+  {
+    Canvas image;
+    if ( !LoadCanvas( Files[f], &image ) )
+    {
+      fprintf( stderr, "check-kernels: cannot load %s\n", Files[f] );
+      return 1;
+    }
+    int width = image.Width;
+    float* alpha = (float*) malloc( width * sizeof( float ) );
+    CanvasPixel* expected = (CanvasPixel*) malloc( width * sizeof( CanvasPixel ) );
+    CanvasPixel* actual = (CanvasPixel*) malloc( width * sizeof( CanvasPixel ) );
+    if ( !alpha || !expected || !actual )
+    {
+      fprintf( stderr, "check-kernels: not enough memory\n" );
+      return 1;
+    }
+
+    for ( unsigned kk = 0; kk < sizeof( kernels ) / sizeof( kernels[0] ); ++kk )
+    {
+      if ( !select_tint_kernel( kernels[kk] ) )
+      {
+        printf( "%s: %s: not supported, skipped\n", Files[f], kernels[kk] );
+        continue;
+      }
+      long pixels = 0;
+      long failed = 0;
+      for ( unsigned cc = 0; cc < sizeof( colors ) / sizeof( colors[0] ); ++cc )
+      {
+        for ( int component = 1; component <= ( HUE | SAT | VAL ); ++component )
+        {
+          tint_brush brush;
+          init_tint_brush( &brush, colors[cc][0], colors[cc][1], colors[cc][2], 240.0, component );
+          for ( int jj = 0; jj < image.Height; ++jj )
+          {
+            const CanvasPixel* row = CANVAS_ROW( &image, jj );
+            for ( int ii = 0; ii < width; ++ii )
+            {
+              alpha[ii] = ( ( ii + 7 * jj ) % 257 ) / 256.0;
+            }
+            memcpy( expected, row, width * sizeof( CanvasPixel ) );
+            memcpy( actual, row, width * sizeof( CanvasPixel ) );
+            tint_row_scalar( expected, alpha, width, &brush );
+            tint_row( actual, alpha, width, &brush );
+
+            for ( int ii = 0; ii < width; ++ii )
+            {
+              CanvasPixel ee = expected[ii];
+              CanvasPixel aa = actual[ii];
+              if ( abs( (int) GET_RED( ee ) - (int) GET_RED( aa ) ) <= 1
+                   && abs( (int) GET_GREEN( ee ) - (int) GET_GREEN( aa ) ) <= 1
+                   && abs( (int) GET_BLUE( ee ) - (int) GET_BLUE( aa ) ) <= 1 )
+              {
+                continue;
+              }
+              if ( failed++ < 10 )
+              {
+                printf( "%s: %s: pixel (%d,%d) %06lx tinted to %06lx, scalar %06lx\n",
+                        Files[f], kernels[kk], ii, jj, (unsigned long) row[ii] & 0xffffff,
+                        (unsigned long) aa & 0xffffff, (unsigned long) ee & 0xffffff );
+              }
+            }
+            pixels += width;
+          }
+        }
+      }
+      printf( "%s: %s: %ld pixels, %ld differ by more than 1\n",
+              Files[f], kernels[kk], pixels, failed );
+      checked += pixels;
+      if ( failed )
+      {
+        status = 1;
+      }
+    }
+    free( alpha );
+    free( expected );
+    free( actual );
+    FreeCanvasMemory( image.Pixels );
+  }
+  select_tint_kernel( NULL );
+#ifdef TINT_SIMD
+  if ( 0 == checked )
+  {
+    printf( "check-kernels: no pixel was compared\n" );
+    status = 1;
+  }
+#endif
+  return status;
+}
+
+/* Check the fixed-point HSV conversions over all 2^24 colors.  Every color
+   converted by rgb2hsv_fixed() and back by hsv2rgb_fixed() must be
+   reproduced exactly; its value must be exact, and its hue and saturation
+   must be within HSV_CHECK_BOUND units of HSV_ONE of the exact ones.  Return
+   the exit status of the program: 1 if a bound is exceeded. */
+
+#define HSV_CHECK_BOUND 1
+
+static int
+check_hsv()
+{
+  long round_trip = 0;
+  long off = 0;
+  double worst_hue = 0.0;
+  double worst_sat = 0.0;
+
+  for ( int rr = 0; rr < 256; ++rr )
+  {
+    for ( int gg = 0; gg < 256; ++gg )
+    {
+      for ( int bb = 0; bb < 256; ++bb )
+      {
+        fixed_hsv hsv = { 0, 0, 0 };
+        rgb2hsv_fixed( rr, gg, bb, &hsv );
+        int r2, g2, b2;
+        hsv2rgb_fixed( &hsv, &r2, &g2, &b2 );
+        if ( r2 != rr || g2 != gg || b2 != bb )
+        {
+          ++round_trip;
+        }
+
+        int max = MAX( MAX( rr, gg ), bb );
+        int delta = max - MIN( MIN( rr, gg ), bb );
+        double hue_error = 0.0;
+        double sat_error = fabs( hsv.sat - ( max ? (double) HSV_ONE * delta / max : 0.0 ) );
+        if ( delta )
+        {
+          double hue;
+          if ( rr == max )
+          {
+            hue = (double) ( gg - bb ) / delta;
+          }
+          else if ( gg == max )
+          {
+            hue = 2.0 + (double) ( bb - rr ) / delta;
+          }
+          else
+          {
+            hue = 4.0 + (double) ( rr - gg ) / delta;
+          }
+          hue = ( hue < 0.0 ? hue + 6.0 : hue ) * HSV_ONE;
+          hue_error = fabs( hsv.hue - hue );
+          hue_error = MIN( hue_error, HSV_HUE_FULL - hue_error );
+        }
+        worst_hue = MAX( worst_hue, hue_error );
+        worst_sat = MAX( worst_sat, sat_error );
+        if ( hsv.val != max << 8 || hue_error > HSV_CHECK_BOUND || sat_error > HSV_CHECK_BOUND )
+        {
+          if ( off++ < 10 )
+          {
+            printf( "check-hsv: %d %d %d: hue %d, sat %d, val %d\n",
+                    rr, gg, bb, hsv.hue, hsv.sat, hsv.val );
+          }
+        }
+      }
+    }
+  }
+  printf( "check-hsv: %ld colors not reproduced, %ld off by more than %d unit; "
+          "largest error of hue %.3f, of saturation %.3f units\n",
+          round_trip, off, HSV_CHECK_BOUND, worst_hue, worst_sat );
+  return ( round_trip || off ) ? 1 : 0;
+}
+
+/* Canvases from 64 megabytes up are kept in the canvas store, if any. */
+
+#define CANVAS_STORE_THRESHOLD ( (size_t) 64 << 20 )
+
 /*****************************************************************************/
 /* MAIN PROGRAM START                                                        */
 /*****************************************************************************/
@@ -1082,14 +3169,97 @@ move_cursor( int XX, int YY, unsigned int ButtonDown )
 /* Main initializes the canvases (defined globably) fills them with a
    red-green ramp and then calls LiftOff() to start the User Interface
    thread.
+
+   When started as
+
+     paint -replay <strokes> <input.ppm> <output.ppm> [<runs>]
+
+   main replays the stroke file instead and never calls LiftOff().  See
+   replay_strokes().  The option "-kernel scalar|sse4.1|avx2" overrides the
+   tinting kernel chosen for the processor.  The option "-threads <n>" sets
+   the number of threads tinting large dabs, one per processor by default.
+   The option "-nocache" disables the tint cache, and "-history <megabytes>"
+   sets the memory budget of the undo history.  The option "-store
+   <directory>" keeps canvases of CANVAS_STORE_THRESHOLD bytes or more in
+   files of that directory instead of RAM (see SetCanvasStore()).
+
+     paint -bench-load <runs> <file.ppm>...
+
+   measures how fast the files are loaded instead.  See bench_load().
+
+     paint -check-kernels <file.ppm>...
+
+   checks that the vector tinting kernels agree with the scalar one on the
+   files and exits with status 1 if they do not.  See check_kernels().
+
+     paint -check-hsv
+
+   checks the fixed-point HSV conversions exhaustively.  See check_hsv().
 */
 
 int
 main( int argc, char *argv[] )
 {
   int i, buf_width, buf_height, num_canvases, r, g;
-  int buf_size;
-  unsigned long* buf;
+  CanvasPixel* buf;
+
+  init_fixed_hsv();
+  update_brush_mask();
+  select_tint_kernel( NULL );
+
+  int replay = 0;
+  long threads = sysconf( _SC_NPROCESSORS_ONLN );
+  for ( i = 1; i < argc; i++ )
+  {
+    if ( !strcmp( argv[i], "-threads" ) && i + 1 < argc )
+    {
+      threads = atoi( argv[++i] );
+    }
+    else if ( !strcmp( argv[i], "-nocache" ) )
+    {
+      tint_caches.enabled = false;
+    }
+    else if ( !strcmp( argv[i], "-history" ) && i + 1 < argc )
+    {
+      long megabytes = atol( argv[++i] );
+      history.budget = MAX( megabytes, 0L ) << 20;
+    }
+    else if ( !strcmp( argv[i], "-store" ) && i + 1 < argc )
+    {
+      SetCanvasStore( argv[++i], CANVAS_STORE_THRESHOLD );
+    }
+    else if ( !strcmp( argv[i], "-kernel" ) && i + 1 < argc )
+    {
+      if ( !select_tint_kernel( argv[++i] ) )
+      {
+        fprintf( stderr, "Tinting kernel %s is not available.\n", argv[i] );
+        return 1;
+      }
+    }
+    else if ( !strcmp( argv[i], "-replay" ) && i + 3 < argc )
+    {
+      replay = i;
+      i += 3;
+    }
+    else if ( !strcmp( argv[i], "-bench-load" ) && i + 2 < argc )
+    {
+      return bench_load( argv + i + 2, argc - i - 2, MAX( atoi( argv[i + 1] ), 1 ) );
+    }
+    else if ( !strcmp( argv[i], "-check-kernels" ) && i + 1 < argc )
+    {
+      return check_kernels( argv + i + 1, argc - i - 1 );
+    }
+    else if ( !strcmp( argv[i], "-check-hsv" ) )
+    {
+      return check_hsv();
+    }
+  }
+  start_tint_pool( MIN( MAX( threads, 1 ), 64 ) );
+  if ( replay )
+  {
+    int runs = ( replay + 4 < argc ) ? atoi( argv[replay + 4] ) : 1;
+    return replay_strokes( argv[replay + 1], argv[replay + 2], argv[replay + 3], MAX( runs, 1 ) );
+  }
 
   /* Assign red-green ramp to the canvas pixels */
   num_canvases = 2;
@@ -1097,11 +3267,10 @@ main( int argc, char *argv[] )
   {
     buf_width = Canvases[i].Width;
     buf_height = Canvases[i].Height;
-    buf_size = buf_width * buf_height;
 
     /* Be sure to allocate your canvas before lift_off() */
 
-    Canvases[i].Pixels = (unsigned long *)malloc(buf_size * sizeof(unsigned long));
+    Canvases[i].Pixels = AllocCanvasPixels(buf_width, buf_height);
 
     buf = Canvases[i].Pixels;
     /* Fill buffers with red-green ramp */
@@ -1113,7 +3282,6 @@ main( int argc, char *argv[] )
       }
     }
   }
-  init_visual_canvas();
   brush_visualization();
 
   LiftOff( &argc, argv, PushButtons, DialogButtons, ChoiceButtons, Sliders, Canvases );
@@ -0,0 +1,232 @@
+/* CANVAS PIXEL ACCESS AND MEMORY.
+
+   Helpers to walk the Pixels array of a canvas row by row, and the
+   allocator of canvas memory. */
+
+
+#include "xsupport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+/* CANVAS MEMORY. */
+
+/* Alignment of every block, enough for the widest vector loads, and of
+the blocks large enough to be backed by transparent huge pages. */
+
+#define BLOCK_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (1<<21)
+
+/* The registry of the live blocks, in no particular order, with the
+number of bytes each block can hold. A mapped block lives in a file of
+the canvas store rather than in anonymous memory. */
+
+typedef struct {
+  void *Data;
+  size_t Capacity;
+  int Mapped;
+} CanvasBlock;
+
+static CanvasBlock *Blocks=NULL;
+static int BlockCount=0;
+static int BlockSize=0;
+static size_t LiveBytes=0;
+
+/* The directory of the canvas store, or NULL if there is none, and the
+size from which blocks are placed in it. */
+
+static char *StoreDirectory=NULL;
+static size_t StoreThreshold=0;
+
+/* Maps a block of Bytes bytes onto a new file of the canvas store.
+The file is unlinked at once, so that it disappears with the mapping,
+even if the program crashes. Returns NULL on failure. */
+
+static void *MapStoreBlock(size_t Bytes) {
+
+  char *Name=(char *)(malloc(strlen(StoreDirectory)+16));
+  if (!Name)
+    return NULL;
+  sprintf(Name,"%s/canvas.XXXXXX",StoreDirectory);
+  int File=mkstemp(Name);
+  if (File<0) {
+    free(Name);
+    return NULL;
+  }
+  unlink(Name);
+  free(Name);
+  void *Data=MAP_FAILED;
+  if (!ftruncate(File,off_t(Bytes)))
+    Data=mmap(NULL,Bytes,PROT_READ|PROT_WRITE,MAP_SHARED,File,0);
+  close(File);
+  return (Data==MAP_FAILED) ? NULL : Data;
+}
+
+/* Returns the index of the block at Data in the registry, or -1 if
+Data was not allocated by AllocCanvasMemory(). */
+
+static int FindBlock(void *Data) {
+
+  for (int i=0;i<BlockCount;i++)
+    if (Blocks[i].Data==Data)
+      return i;
+  return -1;
+}
+
+
+/* EXTERNAL INTERFACE. */
+
+int ClipCanvasRect(Canvas *C,
+                   int *FromX,
+                   int *ToX,
+                   int *FromY,
+                   int *ToY) {
+
+  if (*FromX<0)
+    *FromX=0;
+  if (*FromY<0)
+    *FromY=0;
+  if (*ToX>=C->Width)
+    *ToX=C->Width-1;
+  if (*ToY>=C->Height)
+    *ToY=C->Height-1;
+  if (*FromX>*ToX || *FromY>*ToY)
+    return 0;
+  return *ToY-*FromY+1;
+}
+
+CanvasSpan CanvasRowSpan(Canvas *C,
+                         int FromX,
+                         int ToX,
+                         int Y) {
+
+  CanvasSpan Span;
+  Span.Pixels=&PIXEL(C,FromX,Y);
+  Span.Length=ToX-FromX+1;
+  return Span;
+}
+
+void *AllocCanvasMemory(size_t Bytes) {
+
+  if (BlockCount==BlockSize) {
+    int Size=BlockSize ? 2*BlockSize : 16;
+    CanvasBlock *Grown=(CanvasBlock *)(realloc(Blocks,Size*sizeof(CanvasBlock)));
+    if (!Grown)
+      return NULL;
+    Blocks=Grown;
+    BlockSize=Size;
+  }
+  int Huge=(Bytes>=HUGE_PAGE_SIZE);
+  void *Data=NULL;
+  int Mapped=0;
+  if (StoreDirectory && Bytes && Bytes>=StoreThreshold) {
+    Data=MapStoreBlock(Bytes);
+    if (Data)
+      Mapped=1;
+    else
+      fprintf(stderr,"Cannot map canvas memory in %s, using RAM.\n",
+	      StoreDirectory);
+  }
+  if (!Data) {
+    if (posix_memalign(&Data,Huge ? HUGE_PAGE_SIZE : BLOCK_ALIGNMENT,
+		       Bytes ? Bytes : 1))
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    if (Huge)
+      madvise(Data,Bytes,MADV_HUGEPAGE);
+#endif
+  }
+  Blocks[BlockCount].Data=Data;
+  Blocks[BlockCount].Capacity=Bytes;
+  Blocks[BlockCount].Mapped=Mapped;
+  BlockCount++;
+  LiveBytes+=Bytes;
+  return Data;
+}
+
+CanvasPixel *AllocCanvasPixels(int Width,
+			       int Height) {
+
+  return (CanvasPixel *)
+    (AllocCanvasMemory(size_t(Width)*size_t(Height)*sizeof(CanvasPixel)));
+}
+
+void *ReuseCanvasMemory(void *Data,
+			size_t Bytes) {
+
+  /* A block more than twice as big as needed is given back rather
+     than kept around. */
+
+  int i=FindBlock(Data);
+  if (i>=0 && Bytes<=Blocks[i].Capacity && Bytes>=Blocks[i].Capacity/2)
+    return Data;
+  void *Block=AllocCanvasMemory(Bytes);
+  if (Block)
+    FreeCanvasMemory(Data);
+  return Block;
+}
+
+void FreeCanvasMemory(void *Data) {
+
+  if (!Data)
+    return;
+  int i=FindBlock(Data);
+  if (i>=0) {
+    LiveBytes-=Blocks[i].Capacity;
+    if (Blocks[i].Mapped)
+      munmap(Data,Blocks[i].Capacity);
+    else
+      free(Data);
+    Blocks[i]=Blocks[--BlockCount];
+  }
+  else
+    free(Data);
+}
+
+size_t LiveCanvasMemory(void) {
+
+  return LiveBytes;
+}
+
+void SetCanvasStore(const char *Directory,
+		    size_t Threshold) {
+
+  free(StoreDirectory);
+  StoreDirectory=Directory ? strdup(Directory) : NULL;
+  StoreThreshold=Threshold;
+}
+
+void PrefetchCanvasRect(Canvas *C,
+			int FromX,
+			int ToX,
+			int FromY,
+			int ToY) {
+
+  int i=FindBlock(C->Pixels);
+  if (i<0 || !Blocks[i].Mapped ||
+      !ClipCanvasRect(C,&FromX,&ToX,&FromY,&ToY))
+    return;
+
+  /* Rows close enough to share pages are merged into one range of
+     pages, so a rectangle as wide as the canvas takes one call. */
+
+  uintptr_t Page=uintptr_t(sysconf(_SC_PAGESIZE));
+  uintptr_t Start=0,End=0;
+  for (int Y=FromY;Y<=ToY;Y++) {
+    uintptr_t From=uintptr_t(&PIXEL(C,FromX,Y))&~(Page-1);
+    uintptr_t To=uintptr_t(&PIXEL(C,ToX,Y)+1);
+    if (End && From<=End) {
+      End=To;
+      continue;
+    }
+    if (End)
+      madvise((void *)(Start),End-Start,MADV_WILLNEED);
+    Start=From;
+    End=To;
+  }
+  madvise((void *)(Start),End-Start,MADV_WILLNEED);
+}
@@ -6,91 +6,357 @@
 
 #include "xsupport.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#if defined(__SSE2__) && !defined(XSUPPORT_LONG_PIXELS)
+#include <emmintrin.h>
+#define PPM_SSE2
+#endif
 
-/* EXTERNAL INTERFACE. */
 
-int LoadCanvas(char *Filename,
-	       Canvas *C) {
+/* PPM HEADER. */
 
-  /* Open file. */
+/* Advances *P past white space and comments, which may appear before
+each token of the header. Returns 0 if the header ends prematurely. */
+
+static int SkipSpace(const unsigned char **P,
+		     const unsigned char *End) {
+
+  const unsigned char *Q=*P;
+  while (Q<End)
+    if (*Q=='#')
+      while (Q<End && *Q!='\n' && *Q!='\r')
+	Q++;
+    else if (*Q==' ' || *Q=='\t' || *Q=='\n' || *Q=='\r' ||
+	     *Q=='\v' || *Q=='\f')
+      Q++;
+    else
+      break;
+  *P=Q;
+  return Q<End;
+}
+
+/* Reads a positive decimal number of the header, no greater than
+Limit, into *Value. Returns 0 if there is none. */
+
+static int ReadNumber(const unsigned char **P,
+		      const unsigned char *End,
+		      long Limit,
+		      long *Value) {
 
-  FILE *Input=fopen(Filename,"r");
-  if (!Input)
+  if (!SkipSpace(P,End))
     return 0;
+  const unsigned char *Q=*P;
+  long N=0;
+  for (;Q<End && *Q>='0' && *Q<='9';Q++)
+    if ((N=N*10+(*Q-'0'))>Limit)
+      return 0;
+  if (Q==*P || N==0)
+    return 0;
+  *P=Q;
+  *Value=N;
+  return 1;
+}
+
+/* Parses the header of the binary PPM file of Length bytes at Data.
+The dimensions and the maximum sample value are stored in *Width,
+*Height and *MaxVal, and the offset of the first sample is returned;
+0 is returned if the header is malformed or the file is too short to
+hold the image it describes. */
+
+static size_t ParseHeader(const unsigned char *Data,
+			  size_t Length,
+			  int *Width,
+			  int *Height,
+			  int *MaxVal) {
+
+  const unsigned char *P=Data,*End=Data+Length;
+  long W,H,M;
+  if (Length<2 || P[0]!='P' || P[1]!='6')
+    return 0;
+  P+=2;
+
+  /* Each side of a canvas is an int, and the pixels of a canvas must
+     fit in memory addressed by size_t. */
+
+  if (!ReadNumber(&P,End,INT_MAX,&W))
+    return 0;
+  size_t Rows=SIZE_MAX/sizeof(CanvasPixel)/size_t(W);
+  if (!ReadNumber(&P,End,Rows<INT_MAX ? long(Rows) : INT_MAX,&H) ||
+      !ReadNumber(&P,End,65535,&M))
+    return 0;
+
+  /* A single white space character separates the header from the
+     samples. */
+
+  if (P==End || !(*P==' ' || *P=='\t' || *P=='\n' || *P=='\r'))
+    return 0;
+  P++;
+
+  size_t Offset=P-Data;
+  if ((Length-Offset)/(M<256 ? 3 : 6)<size_t(W)*size_t(H))
+    return 0;
+  *Width=int(W);
+  *Height=int(H);
+  *MaxVal=int(M);
+  return Offset;
+}
+
+/* PIXEL PACKING AND UNPACKING. */
+
+/* With SSE2, 4 pixels (12 bytes) are unpacked or packed at a time: byte
+lane k of the pixel group is moved into place by a shift of k bytes.
+The vector loops access 16 bytes at a time, so they stop short of the
+last pixels (see PPM_SSE2 at the top). */
+
+/* Unpacks Count pixels with 8-bit samples at full scale (maximum value
+255). */
+
+static void UnpackRGB(const unsigned char *Src,
+		      CanvasPixel *Dst,
+		      size_t Count) {
+
+  size_t i=0;
+#ifdef PPM_SSE2
+  const __m128i M0=_mm_setr_epi32(0x00FFFFFF,0,0,0);
+  const __m128i M1=_mm_setr_epi32(0,0x00FFFFFF,0,0);
+  const __m128i M2=_mm_setr_epi32(0,0,0x00FFFFFF,0);
+  const __m128i M3=_mm_setr_epi32(0,0,0,0x00FFFFFF);
+  for (;i+6<=Count;i+=4,Src+=12) {
+    __m128i P=_mm_loadu_si128((const __m128i *)Src);
+    __m128i Q=_mm_or_si128(_mm_and_si128(P,M0),
+			   _mm_and_si128(_mm_slli_si128(P,1),M1));
+    Q=_mm_or_si128(Q,_mm_and_si128(_mm_slli_si128(P,2),M2));
+    Q=_mm_or_si128(Q,_mm_and_si128(_mm_slli_si128(P,3),M3));
+    _mm_storeu_si128((__m128i *)(Dst+i),Q);
+  }
+#endif
+  for (;i<Count;i++,Src+=3)
+    Dst[i]=CanvasPixel(Src[0])|(CanvasPixel(Src[1])<<8)|
+      (CanvasPixel(Src[2])<<16);
+}
+
+/* Unpacks Count pixels with samples of 1 byte (MaxVal<256) or 2 bytes
+(most significant first), rescaling them from [0,MaxVal] to
+[0,255]. */
+
+static void UnpackScaledRGB(const unsigned char *Src,
+			    CanvasPixel *Dst,
+			    size_t Count,
+			    int MaxVal) {
 
-  /* Read magic number. */
+  if (MaxVal<256) {
+    CanvasPixel Scale[256];
+    for (int v=0;v<256;v++)
+      Scale[v]=((v<MaxVal ? v : MaxVal)*255+MaxVal/2)/MaxVal;
+    for (size_t i=0;i<Count;i++,Src+=3)
+      Dst[i]=Scale[Src[0]]|(Scale[Src[1]]<<8)|(Scale[Src[2]]<<16);
+    return;
+  }
+  for (size_t i=0;i<Count;i++,Src+=6) {
+    CanvasPixel P=0;
+    for (int c=0;c<3;c++) {
+      uint32_t v=(uint32_t(Src[2*c])<<8)|Src[2*c+1];
+      if (v>uint32_t(MaxVal))
+	v=MaxVal;
+      P|=CanvasPixel((v*255+MaxVal/2)/MaxVal)<<(8*c);
+    }
+    Dst[i]=P;
+  }
+}
+
+/* Packs Count pixels into 8-bit samples. */
+
+static void PackRGB(const CanvasPixel *Src,
+		    unsigned char *Dst,
+		    size_t Count) {
+
+  size_t i=0;
+#ifdef PPM_SSE2
+  const __m128i M0=_mm_setr_epi32(0x00FFFFFF,0,0,0);
+  const __m128i M1=_mm_setr_epi32(0,0x00FFFFFF,0,0);
+  const __m128i M2=_mm_setr_epi32(0,0,0x00FFFFFF,0);
+  const __m128i M3=_mm_setr_epi32(0,0,0,0x00FFFFFF);
+  for (;i+6<=Count;i+=4,Dst+=12) {
+    __m128i P=_mm_loadu_si128((const __m128i *)(Src+i));
+    __m128i Q=_mm_or_si128(_mm_and_si128(P,M0),
+			   _mm_srli_si128(_mm_and_si128(P,M1),1));
+    Q=_mm_or_si128(Q,_mm_srli_si128(_mm_and_si128(P,M2),2));
+    Q=_mm_or_si128(Q,_mm_srli_si128(_mm_and_si128(P,M3),3));
+    _mm_storeu_si128((__m128i *)Dst,Q);
+  }
+#endif
+  for (;i<Count;i++,Dst+=3) {
+    Dst[0]=(unsigned char)(GET_RED(Src[i]));
+    Dst[1]=(unsigned char)(GET_GREEN(Src[i]));
+    Dst[2]=(unsigned char)(GET_BLUE(Src[i]));
+  }
+}
 
-  fscanf(Input,"P6\n");
+/* FILE OUTPUT. */
 
-  /* Comment line(s). */
+/* Writes Length bytes at Data to the file descriptor Output. Returns 0
+on failure. */
 
-  int Data;
-  while ((Data=getc(Input))=='#')
-    fscanf(Input,"%*[^\n]\n");
-  ungetc(Data,Input);
+static int WriteAll(int Output,
+		    const unsigned char *Data,
+		    size_t Length) {
 
-  /* Image dimensions. */
+  while (Length) {
+    ssize_t Done=write(Output,Data,Length);
+    if (Done<0 && errno==EINTR)
+      continue;
+    if (Done<=0)
+      return 0;
+    Data+=Done;
+    Length-=size_t(Done);
+  }
+  return 1;
+}
+
+/* Number of pixels packed into the output buffer at a time. */
+
+#define SAVE_CHUNK (1<<18)
 
-  if (fscanf(Input,"%d %d",&C->Width,&C->Height)!=2 ||
-      C->Width==0 || C->Height==0)
+/* EXTERNAL INTERFACE. */
+
+int LoadCanvas(char *Filename,
+	       Canvas *C) {
+
+  /* Open file. */
+
+  int Input=open(Filename,O_RDONLY);
+  if (Input<0)
     return 0;
+  struct stat Info;
+  if (fstat(Input,&Info) || !S_ISREG(Info.st_mode) ||
+      Info.st_size<=0) {
+    close(Input);
+    return 0;
+  }
+  size_t Length=size_t(Info.st_size);
 
-  /* Maximum value in image. */
+  /* Map the whole file; if it cannot be mapped, read it in one go. */
 
-  fscanf(Input,"%*d%*c");
+  unsigned char *Data=(unsigned char *)
+    mmap(NULL,Length,PROT_READ,MAP_PRIVATE,Input,0);
+  int Mapped=(Data!=MAP_FAILED);
+  if (Mapped)
+    madvise(Data,Length,MADV_SEQUENTIAL);
+  else {
+    Data=(unsigned char *)(malloc(Length));
+    size_t Done=0;
+    while (Data && Done<Length) {
+      ssize_t Got=read(Input,Data+Done,Length-Done);
+      if (Got<=0) {
+	free(Data);
+	Data=NULL;
+      }
+      else
+	Done+=size_t(Got);
+    }
+  }
+  close(Input);
+  if (!Data)
+    return 0;
 
-  /* Allocate space for the image. */
+  /* Header. */
 
-  int Size=C->Width*C->Height;
-  C->Pixels=(unsigned long *)(malloc(Size*sizeof(unsigned long)));
+  int Width,Height,MaxVal;
+  size_t Offset=ParseHeader(Data,Length,&Width,&Height,&MaxVal);
 
-  /* Load image. */
+  /* Allocate space for the image and load it. */
 
-  unsigned long *Buffer=C->Pixels;
-  for (int i=0;i<Size;i++,Buffer++) {
-    char Data;
-    fread(&Data,1,1,Input);
-    SET_RED(*Buffer,Data);
-    fread(&Data,1,1,Input);
-    SET_GREEN(*Buffer,Data);
-    fread(&Data,1,1,Input);
-    SET_BLUE(*Buffer,Data);
+  CanvasPixel *Pixels=NULL;
+  if (Offset) {
+    size_t Size=size_t(Width)*size_t(Height);
+    Pixels=AllocCanvasPixels(Width,Height);
+    if (Pixels) {
+      if (MaxVal==255)
+	UnpackRGB(Data+Offset,Pixels,Size);
+      else
+	UnpackScaledRGB(Data+Offset,Pixels,Size,MaxVal);
+    }
   }
-  fclose(Input);
+  if (Mapped)
+    munmap(Data,Length);
+  else
+    free(Data);
+  if (!Pixels)
+    return 0;
+  C->Width=Width;
+  C->Height=Height;
+  C->Pixels=Pixels;
   return 1;
 }
 
 int SaveCanvas(char *Filename,
 	       Canvas *C) {
 
-  /* Open file. */
+  /* The image is written to a temporary file next to the target, which
+     replaces the target only once it is complete and on disk, so a
+     failed save never damages an existing file. */
 
-  FILE *Output=fopen(Filename,"w");
-  if (!Output)
+  size_t NameLength=strlen(Filename);
+  char *Temporary=(char *)(malloc(NameLength+8));
+  unsigned char *Buffer=(unsigned char *)(malloc(3*SAVE_CHUNK+16));
+  if (!Temporary || !Buffer) {
+    free(Temporary);
+    free(Buffer);
     return 0;
+  }
+  memcpy(Temporary,Filename,NameLength);
+  strcpy(Temporary+NameLength,".XXXXXX");
+  int Output=mkstemp(Temporary);
+  if (Output<0) {
+    free(Temporary);
+    free(Buffer);
+    return 0;
+  }
+
+  /* Keep the permissions of the file being replaced, or else give the
+     new file the usual ones. */
+
+  struct stat Info;
+  mode_t Mode;
+  if (!stat(Filename,&Info))
+    Mode=Info.st_mode&07777;
+  else {
+    mode_t Mask=umask(0);
+    umask(Mask);
+    Mode=0666&~Mask;
+  }
+  int Saved=!fchmod(Output,Mode);
 
   /* Print header. */
-    
-  fprintf(Output,"P6\n");
-  fprintf(Output,"# Comment Line\n");
-  fprintf(Output,"%d %d\n",C->Width,C->Height);
-  fprintf(Output,"255\n");
+
+  int Length=sprintf((char *)Buffer,"P6\n# Comment Line\n%d %d\n255\n",
+		     C->Width,C->Height);
+  Saved=Saved && WriteAll(Output,Buffer,size_t(Length));
 
   /* Save image. */
 
-  int Size=C->Width*C->Height;
-  unsigned long *Buffer=C->Pixels;
-  for (int i=0;i<Size;i++,Buffer++) {
-    char Data=char(GET_RED(*Buffer));
-    fwrite(&Data,1,1,Output);
-    Data=char(GET_GREEN(*Buffer));
-    fwrite(&Data,1,1,Output);
-    Data=char(GET_BLUE(*Buffer));
-    fwrite(&Data,1,1,Output);
+  size_t Size=size_t(C->Width)*size_t(C->Height);
+  for (size_t i=0;Saved && i<Size;i+=SAVE_CHUNK) {
+    size_t Count=(Size-i<SAVE_CHUNK ? Size-i : SAVE_CHUNK);
+    PackRGB(C->Pixels+i,Buffer,Count);
+    Saved=WriteAll(Output,Buffer,3*Count);
   }
-  fclose(Output);
-  return 1;
+  Saved=Saved && !fsync(Output);
+  Saved=!close(Output) && Saved;
+  Saved=Saved && !rename(Temporary,Filename);
+  if (!Saved)
+    unlink(Temporary);
+  free(Temporary);
+  free(Buffer);
+  return Saved;
 }
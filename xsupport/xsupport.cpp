@@ -15,6 +15,15 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+
+#if defined(__SSE2__) && !defined(XSUPPORT_LONG_PIXELS)
+#include <emmintrin.h>
+#define ROW_SSE2
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -67,6 +76,27 @@ static const int DitheringPattern[4][4]={
 
 static const int ButtonsPerRow=6;
 
+/* Canvas updates are presented at most this many times per second; 0
+presents every update immediately. */
+
+static int FrameRate=60;
+
+/* Maximum number of separate damaged rectangles kept per canvas. */
+
+static const int MaxDamage=16;
+
+/* Range of the zoom of a canvas view, as a power of two, and the color
+of the window area beyond the canvas. */
+
+static const int MinZoom=-4;
+static const int MaxZoom=4;
+static const CanvasPixel ViewBackground=0x404040;
+
+/* The shrunk copies of a canvas are kept up to date in tiles of
+2^MipTileShift by 2^MipTileShift canvas pixels. */
+
+static const int MipTileShift=6;
+
 
 /* GLOBAL VARIABLES. */
 
@@ -94,6 +124,20 @@ static int MainLoopStarted=0;
 
 static int BitPlanes;
 
+/* Visual of the canvas windows. */
+
+static Visual *CanvasVisual;
+
+/* Flag indicating whether canvas images are kept in shared memory
+(MIT-SHM extension). */
+
+static int UseShm=0;
+
+/* Flag set by ShmErrorHandler() when the X server fails to attach a
+shared memory segment. */
+
+static int ShmFailed;
+
 /* Dithered primary intensities (8-bit mode only). */
 
 typedef int Intensities[256][4][4];
@@ -110,6 +154,20 @@ static int SingleIntensities[256];
 
 static Cursor BlankCurs = 0;
 
+/* All canvases, as passed to LiftOff(). */
+
+static Canvas *AllCanvases=0;
+
+/* Timer presenting the damaged canvas rectangles of the next frame. */
+
+static XtIntervalId FrameTimer=0;
+
+/* All sliders, as passed to LiftOff(), and the timer delivering the
+values of the live sliders dragged during the last frame. */
+
+static Slider *AllSliders=0;
+static XtIntervalId SliderTimer=0;
+
 /* PRIVATE WIDGET DATA AND ACCESSORS. */
 
 /* Choice buttons. */
@@ -125,6 +183,8 @@ inline ChoiceButtonExtension *CBExt(ChoiceButton *CB) {
 
 typedef struct {
   Widget Handle;
+  int Dragged; /* DragValue is yet to be delivered. */
+  float DragValue;
 } SliderExtension;
 
 inline SliderExtension *SExt(Slider *S) {
@@ -132,6 +192,13 @@ inline SliderExtension *SExt(Slider *S) {
 
 /* Canvases. */
 
+typedef struct {
+  int FromX;
+  int ToX;
+  int FromY;
+  int ToY;
+} DamageRect;
+
 typedef struct {
   Widget Handle;
   XImage *Image;
@@ -144,6 +211,34 @@ typedef struct {
 
   XColor Colors[Shades]; /* 8-bit mode. */
   int GammaCorrect;
+
+  XShmSegmentInfo Shm; /* Valid if Shm.shmaddr is not 0. */
+
+  DamageRect Damage[MaxDamage]; /* Not yet presented. */
+  int DamageCount;
+
+  int OverlayCount; /* See SetCanvasOverlay(). */
+  int OverlaySize;
+  int *OverlayX; /* Canvas coordinates. */
+  int *OverlayY;
+  CanvasPixel OverlayColor;
+  DamageRect OverlayBounds; /* Empty if FromX>ToX. */
+
+  int Zoom; /* See SetCanvasView(). */
+  int OriginX;
+  int OriginY;
+  int ViewWidth; /* Size of the window and of Image. */
+  int ViewHeight;
+  int ViewDirty; /* The whole window is to be redrawn. */
+  CanvasPixel *ViewRow; /* One window row of scaled pixels. */
+  CanvasPixel *ViewBlank; /* One window row of ViewBackground. */
+  CanvasPixel *Mip[-MinZoom]; /* Canvas shrunk 2^(i+1) times, or 0. */
+  unsigned char *MipStale; /* Per mip tile, bit i set if Mip[i] is stale. */
+  int MipColumns; /* Number of mip tiles across the canvas. */
+  int MipRows;
+  int Panning; /* The middle button drags the view. */
+  int PanX; /* Window coordinates of the last drag position. */
+  int PanY;
 } CanvasExtension;
 
 inline CanvasExtension *CExt(Canvas *C) {
@@ -196,6 +291,135 @@ static void InitDitheredIntensities(int ILevels,
 }
 
 
+/* CANVAS IMAGES. */
+
+/* The X image of a canvas holds the canvas pixels converted to the
+format of the screen. When the X server runs on the same machine and
+supports the MIT-SHM extension, the image data lives in a shared
+memory segment, and presenting a rectangle of the image does not copy
+its pixels through the X connection. Otherwise, the image data is
+allocated with malloc() and sent with XPutImage(). */
+
+static int ShmErrorHandler(Display *,
+                           XErrorEvent *) {
+  ShmFailed=1;
+  return 0;
+}
+
+/* Creates a shared memory image of Width by Height pixels for the
+canvas extension CE. Returns 0 if the image cannot be created, in which
+case nothing needs to be cleaned up. */
+
+static int CreateShmImage(CanvasExtension *CE,
+                          int Width,
+                          int Height) {
+
+  CE->Image=XShmCreateImage(Disp,CanvasVisual,BitPlanes,ZPixmap,0,&CE->Shm,
+                            Width,Height);
+  if (!CE->Image)
+    return 0;
+  CE->Shm.shmid=shmget(IPC_PRIVATE,CE->Image->bytes_per_line*Height,
+                       IPC_CREAT|0600);
+  if (CE->Shm.shmid<0) {
+    XDestroyImage(CE->Image);
+    return 0;
+  }
+  CE->Shm.shmaddr=CE->Image->data=(char *)(shmat(CE->Shm.shmid,0,0));
+  if (CE->Shm.shmaddr==(char *)(-1)) {
+    shmctl(CE->Shm.shmid,IPC_RMID,0);
+    CE->Image->data=0;
+    CE->Shm.shmaddr=0;
+    XDestroyImage(CE->Image);
+    return 0;
+  }
+  CE->Shm.readOnly=False;
+
+  /* Attaching fails asynchronously, e.g. for a remote display. */
+
+  ShmFailed=0;
+  XErrorHandler Handler=XSetErrorHandler(ShmErrorHandler);
+  XShmAttach(Disp,&CE->Shm);
+  XSync(Disp,False);
+  XSetErrorHandler(Handler);
+
+  /* The segment is destroyed as soon as both sides detach from it,
+     even if the program crashes. */
+
+  shmctl(CE->Shm.shmid,IPC_RMID,0);
+  if (ShmFailed) {
+    shmdt(CE->Shm.shmaddr);
+    CE->Image->data=0;
+    CE->Shm.shmaddr=0;
+    XDestroyImage(CE->Image);
+    return 0;
+  }
+  return 1;
+}
+
+/* Creates the X image of Width by Height pixels for the canvas
+extension CE. */
+
+static void CreateCanvasImage(CanvasExtension *CE,
+                              int Width,
+                              int Height) {
+
+  CE->Shm.shmaddr=0;
+  if (UseShm) {
+    if (CreateShmImage(CE,Width,Height))
+      return;
+    fprintf(stderr,"Shared memory images unavailable, using XPutImage().\n");
+    UseShm=0;
+  }
+
+  /* The image data is sized by the layout Xlib chooses for the depth
+     of the screen. */
+
+  CE->Image=XCreateImage(Disp,CanvasVisual,BitPlanes,ZPixmap,0,
+                         NULL,Width,Height,32,0);
+  if (CE->Image)
+    CE->Image->data=(char *)
+      (AllocCanvasMemory(size_t(CE->Image->bytes_per_line)*Height));
+  if (!CE->Image || !CE->Image->data) {
+    fprintf(stderr,"Not enough memory for canvas.\n");
+    exit(1);
+  }
+}
+
+static void DestroyCanvasImage(CanvasExtension *CE) {
+
+  if (CE->Shm.shmaddr) {
+    XShmDetach(Disp,&CE->Shm);
+    XSync(Disp,False);
+    shmdt(CE->Shm.shmaddr);
+    CE->Image->data=0;
+    CE->Shm.shmaddr=0;
+  }
+  else {
+    FreeCanvasMemory(CE->Image->data);
+    CE->Image->data=0;
+  }
+  XDestroyImage(CE->Image);
+}
+
+/* Sends the rectangle of Width by Height pixels with its top left
+corner at (X,Y) of the X image of the canvas extension CE to the
+canvas window. */
+
+static void PutCanvasImage(CanvasExtension *CE,
+                           int X,
+                           int Y,
+                           int Width,
+                           int Height) {
+
+  if (CE->Shm.shmaddr)
+    XShmPutImage(Disp,XtWindow(CE->Handle),Gc,CE->Image,X,Y,X,Y,
+                 Width,Height,False);
+  else
+    XPutImage(Disp,XtWindow(CE->Handle),Gc,CE->Image,X,Y,X,Y,
+              Width,Height);
+}
+
+
 /* WIDGET PRE-CALLBACKS AND EVENT HANDLERS. */
 
 /* Choice buttons. */
@@ -208,17 +432,60 @@ static void ChoiceButtonPrecallback(Widget w,
 
 /* Sliders. */
 
-static void SliderPrecallback(Widget Slider,
-                              void (*Callback)(float),
-                              XmAnyCallbackStruct *) {
+/* Returns the value of slider widget Handle as displayed. */
+
+static float SliderValue(Widget Handle) {
 
   short Decimals;
   int Value;
-  XtVaGetValues(Slider,
+  XtVaGetValues(Handle,
                 XmNvalue,&Value,
                 XmNdecimalPoints,&Decimals,
                 NULL);
-  (*Callback)(Value/pow(10,Decimals));
+  return Value/pow(10,Decimals);
+}
+
+static void SliderPrecallback(Widget Handle,
+                              Slider *S,
+                              XmAnyCallbackStruct *) {
+
+  /* The final value supersedes any drag value not yet delivered. */
+
+  SExt(S)->Dragged=0;
+  (*(S->Callback))(SliderValue(Handle));
+}
+
+/* Calls back the live sliders dragged since the last call with their
+latest values. While values keep coming, it runs again one frame
+later, so a dragged slider calls back at most once per frame. */
+
+static void DeliverSliderDrags(XtPointer,
+                               XtIntervalId *) {
+
+  SliderTimer=0;
+  int Delivered=0;
+  for (int i=0;AllSliders[i].Callback;i++) {
+    SliderExtension *SE=SExt(&AllSliders[i]);
+    if (SE->Dragged) {
+      SE->Dragged=0;
+      (*(AllSliders[i].Callback))(SE->DragValue);
+      Delivered=1;
+    }
+  }
+  if (Delivered && FrameRate)
+    SliderTimer=XtAppAddTimeOut(AppContext,1000/FrameRate,
+                                XtTimerCallbackProc(DeliverSliderDrags),0);
+}
+
+static void SliderDragPrecallback(Widget Handle,
+                                  Slider *S,
+                                  XmAnyCallbackStruct *) {
+
+  SliderExtension *SE=SExt(S);
+  SE->DragValue=SliderValue(Handle);
+  SE->Dragged=1;
+  if (!SliderTimer)
+    DeliverSliderDrags(0,0);
 }
 
 /* Dialog buttons. */
@@ -281,10 +548,16 @@ static void DrawingExpose(Widget,
                           CanvasExtension *CE,
                           XmDrawingAreaCallbackStruct *CbS) {
 
-  XPutImage(Disp,XtWindow(CE->Handle),Gc,CE->Image,
-            CbS->event->xexpose.x,CbS->event->xexpose.y,
-            CbS->event->xexpose.x,CbS->event->xexpose.y,
-            CbS->event->xexpose.width,CbS->event->xexpose.height);
+  int X=CbS->event->xexpose.x;
+  int Y=CbS->event->xexpose.y;
+  int Width=CbS->event->xexpose.width;
+  int Height=CbS->event->xexpose.height;
+  if (X+Width>CE->ViewWidth)
+    Width=CE->ViewWidth-X;
+  if (Y+Height>CE->ViewHeight)
+    Height=CE->ViewHeight-Y;
+  if (Width>0 && Height>0)
+    PutCanvasImage(CE,X,Y,Width,Height);
 }
 
 static void SetColormap(CanvasExtension *CE) {
@@ -318,58 +591,869 @@ static void SetColormap(CanvasExtension *CE) {
   XStoreColors(Disp,CE->CMap,CE->Colors,Shades);
 }
 
-static void RedrawCanvasImage(Canvas *C,
-                              int FromX,
-                              int ToX,
-                              int FromY,
-                              int ToY) {
+/* ROW CONVERTERS. */
+
+/* A row converter converts Count canvas pixels, starting at Src, to
+the format of the X image of the canvas extension CE, and stores them
+at canvas coordinates (X,Y) onwards. The specialized converters write
+straight into the image data; they are chosen once per redraw by
+ChooseRowConverter() for the depth, color masks and byte order of the
+image. The generic converter handles every other case through
+XPutPixel(). */
+
+typedef void (*RowConverter)(CanvasExtension *CE,
+                             const CanvasPixel *Src,
+                             int X,
+                             int Y,
+                             int Count);
+
+inline static char *ImageAddress(XImage *Image,
+                                 int X,
+                                 int Y) {
+  return Image->data+Y*Image->bytes_per_line+X*(Image->bits_per_pixel/8);
+}
 
-  CanvasExtension *CE=CExt(C);
+static void RowGeneric(CanvasExtension *CE,
+                       const CanvasPixel *Src,
+                       int X,
+                       int Y,
+                       int Count) {
 
   int SwapRedAndBlue = CE->Image->red_mask != ONLY_RED;
 
-  for (int Y=FromY;Y<=ToY;Y++)
-    for (int X=FromX;X<=ToX;X++)
-      if (TestImage)
-        XPutPixel(CE->Image,X,Y,X%(1<<BitPlanes));
-      else if (BitPlanes==24) {
-        if(SwapRedAndBlue) {
-          unsigned p = (CE->Mask)&PIXEL(C,X,Y);
-          unsigned p1 = (GET_RED(p) << 16) | (GET_GREEN(p) << 8) | GET_BLUE(p);
-          XPutPixel(CE->Image,X,Y,p1);
-        } else {
-          XPutPixel(CE->Image,X,Y,(CE->Mask)&PIXEL(C,X,Y));
-        }
-      } else if (BitPlanes==16) {
-        unsigned p = (CE->Mask)&PIXEL(C,X,Y);
-        unsigned p_r = GET_RED(p) >> 3;
-        unsigned p_g = GET_GREEN(p) >> 2;
-        unsigned p_b = GET_BLUE(p) >> 3;
-        unsigned short p1 = (p_r << 11) | (p_g << 5) | (p_b);
-        XPutPixel(CE->Image,X,Y,p1);
-      } else if (BitPlanes==15) {
-        unsigned p = (CE->Mask)&PIXEL(C,X,Y);
-        unsigned p_r = GET_RED(p) >> 3;
-        unsigned p_g = GET_GREEN(p) >> 3;
-        unsigned p_b = GET_BLUE(p) >> 3;
-        unsigned short p1 = (p_r << 10) | (p_g << 5) | (p_b);
+  for (int ToX=X+Count-1;X<=ToX;X++,Src++)
+    if (TestImage)
+      XPutPixel(CE->Image,X,Y,X%(1<<BitPlanes));
+    else if (BitPlanes==24) {
+      if(SwapRedAndBlue) {
+        unsigned p = (CE->Mask)&(*Src);
+        unsigned p1 = (GET_RED(p) << 16) | (GET_GREEN(p) << 8) | GET_BLUE(p);
         XPutPixel(CE->Image,X,Y,p1);
       } else {
-        unsigned long Pixel=PIXEL(C,X,Y);
-        int CMapEntry;
-        if (CE->Mask==ALL_COLORS) {
-          int Red=RedIs[GET_RED(Pixel)][X%4][Y%4];
-          int Green=GreenIs[GET_GREEN(Pixel)][X%4][Y%4];
-          int Blue=BlueIs[GET_BLUE(Pixel)][X%4][Y%4];
-          CMapEntry=Blue*Reds*Greens+Green*Reds+Red;
-        } else if (CE->Mask==ONLY_RED)
-          CMapEntry=SingleIntensities[GET_RED(Pixel)];
-        else if (CE->Mask==ONLY_GREEN)
-          CMapEntry=SingleIntensities[GET_GREEN(Pixel)];
-        else
-          CMapEntry=SingleIntensities[GET_BLUE(Pixel)];
-        XPutPixel(CE->Image,X,Y,CE->Colors[CMapEntry].pixel);
+        XPutPixel(CE->Image,X,Y,(CE->Mask)&(*Src));
       }
+    } else if (BitPlanes==16) {
+      unsigned p = (CE->Mask)&(*Src);
+      unsigned p_r = GET_RED(p) >> 3;
+      unsigned p_g = GET_GREEN(p) >> 2;
+      unsigned p_b = GET_BLUE(p) >> 3;
+      unsigned short p1 = (p_r << 11) | (p_g << 5) | (p_b);
+      XPutPixel(CE->Image,X,Y,p1);
+    } else if (BitPlanes==15) {
+      unsigned p = (CE->Mask)&(*Src);
+      unsigned p_r = GET_RED(p) >> 3;
+      unsigned p_g = GET_GREEN(p) >> 3;
+      unsigned p_b = GET_BLUE(p) >> 3;
+      unsigned short p1 = (p_r << 10) | (p_g << 5) | (p_b);
+      XPutPixel(CE->Image,X,Y,p1);
+    } else {
+      CanvasPixel Pixel=*Src;
+      int CMapEntry;
+      if (CE->Mask==ALL_COLORS) {
+        int Red=RedIs[GET_RED(Pixel)][X%4][Y%4];
+        int Green=GreenIs[GET_GREEN(Pixel)][X%4][Y%4];
+        int Blue=BlueIs[GET_BLUE(Pixel)][X%4][Y%4];
+        CMapEntry=Blue*Reds*Greens+Green*Reds+Red;
+      } else if (CE->Mask==ONLY_RED)
+        CMapEntry=SingleIntensities[GET_RED(Pixel)];
+      else if (CE->Mask==ONLY_GREEN)
+        CMapEntry=SingleIntensities[GET_GREEN(Pixel)];
+      else
+        CMapEntry=SingleIntensities[GET_BLUE(Pixel)];
+      XPutPixel(CE->Image,X,Y,CE->Colors[CMapEntry].pixel);
+    }
+}
+
+/* The vector loops below handle 4 packed canvas pixels at a time with
+SSE2 (see ROW_SSE2 at the top); the scalar loops finish the row. */
+
+/* The converters for images whose byte order differs from that of the
+host reverse the bytes of every pixel they store. */
+
+inline static uint32_t Reverse32(uint32_t p) {
+  return (p<<24)|((p<<8)&0xFF0000)|((p>>8)&0xFF00)|(p>>24);
+}
+
+inline static uint16_t Reverse16(uint16_t p) {
+  return uint16_t((p<<8)|(p>>8));
+}
+
+/* 24-bit images, with red in the low byte like canvas pixels, or in the
+third byte if SwapRedAndBlue is set, and in the byte order of the host
+unless Reverse is set. */
+
+inline static void Row32Bits(CanvasExtension *CE,
+                             const CanvasPixel *Src,
+                             int X,
+                             int Y,
+                             int Count,
+                             int SwapRedAndBlue,
+                             int Reverse) {
+
+  uint32_t *Dst=(uint32_t *)(ImageAddress(CE->Image,X,Y));
+  uint32_t Mask=CE->Mask;
+  int i=0;
+#ifdef ROW_SSE2
+  __m128i M=_mm_set1_epi32(Mask);
+  __m128i Byte=_mm_set1_epi32(0xFF);
+  __m128i Green=_mm_set1_epi32(0xFF00);
+  for (;i+4<=Count;i+=4) {
+    __m128i Q=_mm_and_si128(_mm_loadu_si128((const __m128i *)(Src+i)),M);
+    if (SwapRedAndBlue) {
+      __m128i P=Q;
+      Q=_mm_or_si128(_mm_slli_epi32(_mm_and_si128(P,Byte),16),
+                     _mm_and_si128(P,Green));
+      Q=_mm_or_si128(Q,_mm_and_si128(_mm_srli_epi32(P,16),Byte));
+    }
+    if (Reverse) {
+      __m128i P=Q;
+      Q=_mm_or_si128(_mm_slli_epi32(P,24),_mm_srli_epi32(P,24));
+      Q=_mm_or_si128(Q,_mm_and_si128(_mm_slli_epi32(P,8),
+                                     _mm_set1_epi32(0xFF0000)));
+      Q=_mm_or_si128(Q,_mm_and_si128(_mm_srli_epi32(P,8),Green));
+    }
+    _mm_storeu_si128((__m128i *)(Dst+i),Q);
+  }
+#endif
+  for (;i<Count;i++) {
+    uint32_t p=Mask&Src[i];
+    if (SwapRedAndBlue)
+      p=(GET_RED(p)<<16)|(GET_GREEN(p)<<8)|GET_BLUE(p);
+    Dst[i]=Reverse ? Reverse32(p) : p;
+  }
+}
+
+static void Row32(CanvasExtension *CE,
+                  const CanvasPixel *Src,
+                  int X,
+                  int Y,
+                  int Count) {
+  Row32Bits(CE,Src,X,Y,Count,0,0);
+}
+
+static void Row32Swap(CanvasExtension *CE,
+                      const CanvasPixel *Src,
+                      int X,
+                      int Y,
+                      int Count) {
+  Row32Bits(CE,Src,X,Y,Count,1,0);
+}
+
+static void Row32Reverse(CanvasExtension *CE,
+                         const CanvasPixel *Src,
+                         int X,
+                         int Y,
+                         int Count) {
+  Row32Bits(CE,Src,X,Y,Count,0,1);
+}
+
+static void Row32SwapReverse(CanvasExtension *CE,
+                             const CanvasPixel *Src,
+                             int X,
+                             int Y,
+                             int Count) {
+  Row32Bits(CE,Src,X,Y,Count,1,1);
+}
+
+/* 16-bit (5-6-5) and 15-bit (5-5-5) images. GreenBits is the number of
+bits of the green component; Reverse is set if the byte order of the
+image is not that of the host. */
+
+inline static void Row16Bits(CanvasExtension *CE,
+                             const CanvasPixel *Src,
+                             int X,
+                             int Y,
+                             int Count,
+                             int GreenBits,
+                             int Reverse) {
+
+  uint16_t *Dst=(uint16_t *)(ImageAddress(CE->Image,X,Y));
+  uint32_t Mask=CE->Mask;
+  int i=0;
+#ifdef ROW_SSE2
+  __m128i M=_mm_set1_epi32(Mask);
+  __m128i RedMask=_mm_set1_epi32(0xF8);
+  __m128i GreenMask=_mm_set1_epi32(GreenBits==6 ? 0xFC00 : 0xF800);
+  __m128i BlueMask=_mm_set1_epi32(0x1F);
+  for (;i+8<=Count;i+=8) {
+    __m128i Packed[2];
+    for (int j=0;j<2;j++) {
+      __m128i P=_mm_and_si128(_mm_loadu_si128((const __m128i *)(Src+i+4*j)),M);
+      __m128i R=_mm_slli_epi32(_mm_and_si128(P,RedMask),GreenBits+2);
+      __m128i G=_mm_srli_epi32(_mm_and_si128(P,GreenMask),
+                               GreenBits==6 ? 5 : 6);
+      __m128i B=_mm_and_si128(_mm_srli_epi32(P,19),BlueMask);
+      /* Sign-extend the low 16 bits, so that the saturating pack
+         keeps them unchanged. */
+      Packed[j]=_mm_srai_epi32(_mm_slli_epi32(_mm_or_si128(_mm_or_si128(R,G),B),16),16);
+    }
+    __m128i Q=_mm_packs_epi32(Packed[0],Packed[1]);
+    if (Reverse)
+      Q=_mm_or_si128(_mm_slli_epi16(Q,8),_mm_srli_epi16(Q,8));
+    _mm_storeu_si128((__m128i *)(Dst+i),Q);
+  }
+#endif
+  for (;i<Count;i++) {
+    uint32_t p=Mask&Src[i];
+    uint16_t q=((GET_RED(p)>>3)<<(GreenBits+5))|
+               ((GET_GREEN(p)>>(8-GreenBits))<<5)|(GET_BLUE(p)>>3);
+    Dst[i]=Reverse ? Reverse16(q) : q;
+  }
+}
+
+static void Row16(CanvasExtension *CE,
+                  const CanvasPixel *Src,
+                  int X,
+                  int Y,
+                  int Count) {
+  Row16Bits(CE,Src,X,Y,Count,6,0);
+}
+
+static void Row15(CanvasExtension *CE,
+                  const CanvasPixel *Src,
+                  int X,
+                  int Y,
+                  int Count) {
+  Row16Bits(CE,Src,X,Y,Count,5,0);
+}
+
+static void Row16Reverse(CanvasExtension *CE,
+                         const CanvasPixel *Src,
+                         int X,
+                         int Y,
+                         int Count) {
+  Row16Bits(CE,Src,X,Y,Count,6,1);
+}
+
+static void Row15Reverse(CanvasExtension *CE,
+                         const CanvasPixel *Src,
+                         int X,
+                         int Y,
+                         int Count) {
+  Row16Bits(CE,Src,X,Y,Count,5,1);
+}
+
+/* 8-bit images, dithered full color. */
+
+static void Row8Dithered(CanvasExtension *CE,
+                         const CanvasPixel *Src,
+                         int X,
+                         int Y,
+                         int Count) {
+
+  unsigned char *Dst=(unsigned char *)(ImageAddress(CE->Image,X,Y));
+  int Row=Y%4;
+  for (int i=0;i<Count;i++,X++) {
+    CanvasPixel Pixel=Src[i];
+    int Red=RedIs[GET_RED(Pixel)][X%4][Row];
+    int Green=GreenIs[GET_GREEN(Pixel)][X%4][Row];
+    int Blue=BlueIs[GET_BLUE(Pixel)][X%4][Row];
+    Dst[i]=CE->Colors[Blue*Reds*Greens+Green*Reds+Red].pixel;
+  }
+}
+
+/* 8-bit images, single primary. */
+
+static void Row8Single(CanvasExtension *CE,
+                       const CanvasPixel *Src,
+                       int X,
+                       int Y,
+                       int Count) {
+
+  unsigned char *Dst=(unsigned char *)(ImageAddress(CE->Image,X,Y));
+  int Shift=CE->Mask==ONLY_RED ? 0 : (CE->Mask==ONLY_GREEN ? 8 : 16);
+  for (int i=0;i<Count;i++)
+    Dst[i]=CE->Colors[SingleIntensities[(Src[i]>>Shift)&0x0FF]].pixel;
+}
+
+static RowConverter ChooseRowConverter(CanvasExtension *CE) {
+
+  XImage *Image=CE->Image;
+  int One=1;
+  int HostByteOrder=*(char *)(&One) ? LSBFirst : MSBFirst;
+
+  int Reverse=Image->byte_order!=HostByteOrder;
+
+  if (TestImage)
+    return &RowGeneric;
+  if (BitPlanes==24 && Image->bits_per_pixel==32) {
+    if (Image->red_mask==0x0000FF && Image->green_mask==0x00FF00 &&
+        Image->blue_mask==0xFF0000)
+      return Reverse ? &Row32Reverse : &Row32;
+    if (Image->red_mask==0xFF0000 && Image->green_mask==0x00FF00 &&
+        Image->blue_mask==0x0000FF)
+      return Reverse ? &Row32SwapReverse : &Row32Swap;
+  } else if (BitPlanes==16 && Image->bits_per_pixel==16)
+    return Reverse ? &Row16Reverse : &Row16;
+  else if (BitPlanes==15 && Image->bits_per_pixel==16)
+    return Reverse ? &Row15Reverse : &Row15;
+  else if (BitPlanes==8 && Image->bits_per_pixel==8) {
+    if (CE->Mask==ALL_COLORS)
+      return &Row8Dithered;
+    return &Row8Single;
+  }
+  return &RowGeneric;
+}
+
+/* CANVAS VIEWS. */
+
+/* The window of a canvas shows it through a view: the canvas pixel
+(OriginX,OriginY) lies at the top left corner of the window, and the
+canvas is magnified 2^Zoom times, or shrunk 2^-Zoom times when Zoom is
+negative. The X image of a canvas has the size of its window, so only
+the visible pixels are ever converted and sent to the X server. A
+magnified pixel is replicated; a shrunk pixel averages the block of
+canvas pixels it covers, and is read from the pyramid described
+below. */
+
+/* Returns V/2^Shift rounded down, for negative V too. */
+
+inline static int FloorShift(int V,
+                             int Shift) {
+  return V>=0 ? V>>Shift : -((-V+(1<<Shift)-1)>>Shift);
+}
+
+/* Returns the number of whole canvas pixels across Size window pixels
+of the view of the canvas extension CE. */
+
+inline static int ViewSpan(CanvasExtension *CE,
+                           int Size) {
+  return CE->Zoom>=0 ? Size>>CE->Zoom : Size<<-CE->Zoom;
+}
+
+/* Returns the window coordinate just past the canvas pixels of a
+canvas Size pixels wide (or high) viewed from Origin, clipped to
+Limit. */
+
+static int ViewEnd(CanvasExtension *CE,
+                   int Size,
+                   int Origin,
+                   int Limit) {
+
+  int64_t End=Size-Origin;
+  if (CE->Zoom>=0)
+    End<<=CE->Zoom;
+  else
+    End=(End+(1<<-CE->Zoom)-1)>>-CE->Zoom;
+  return End<Limit ? int(End) : Limit;
+}
+
+/* Maps the canvas rectangle R of canvas C to the rectangle of the window
+showing it, clipped to the window. Returns 0 if R is not visible. */
+
+static int CanvasToView(Canvas *C,
+                        DamageRect *R) {
+
+  CanvasExtension *CE=CExt(C);
+  int FromX=R->FromX>CE->OriginX ? R->FromX-CE->OriginX : 0;
+  int FromY=R->FromY>CE->OriginY ? R->FromY-CE->OriginY : 0;
+  int ToX=R->ToX-CE->OriginX;
+  int ToY=R->ToY-CE->OriginY;
+  int SpanX=ViewSpan(CE,CE->ViewWidth)+1;
+  int SpanY=ViewSpan(CE,CE->ViewHeight)+1;
+  if (ToX<FromX || ToY<FromY || FromX>SpanX || FromY>SpanY)
+    return 0;
+  if (ToX>SpanX) ToX=SpanX;
+  if (ToY>SpanY) ToY=SpanY;
+  if (CE->Zoom>=0) {
+    R->FromX=FromX<<CE->Zoom;
+    R->FromY=FromY<<CE->Zoom;
+    R->ToX=((ToX+1)<<CE->Zoom)-1;
+    R->ToY=((ToY+1)<<CE->Zoom)-1;
+  } else {
+    R->FromX=FromX>>-CE->Zoom;
+    R->FromY=FromY>>-CE->Zoom;
+    R->ToX=ToX>>-CE->Zoom;
+    R->ToY=ToY>>-CE->Zoom;
+  }
+  if (R->ToX>=CE->ViewWidth) R->ToX=CE->ViewWidth-1;
+  if (R->ToY>=CE->ViewHeight) R->ToY=CE->ViewHeight-1;
+  return R->FromX<=R->ToX && R->FromY<=R->ToY;
+}
+
+/* A view that shrinks the canvas 2^Level times reads the pixels from
+level Level of a pyramid of shrunk copies of the canvas, each half the
+width and height of the one below it. A level is allocated when a view
+first needs it, and brought up to date one mip tile at a time, only
+where the view needs it and only after UpdateCanvas() reported a change
+there. The origin of a shrunk view is a multiple of 2^Level, so that
+window pixels and pyramid pixels line up. */
+
+/* Returns the number of pixels across Size canvas pixels at level
+Level of the pyramid. */
+
+inline static int MipSize(int Size,
+                          int Level) {
+  return (Size+(1<<Level)-1)>>Level;
+}
+
+/* Stores in the pixels FromX to ToX-1 of rows FromY to ToY-1 of Dst,
+DstWidth pixels wide, the rounded average of the 2x2 blocks of Src,
+SrcWidth by SrcHeight pixels, under them. A block cut off by the edge
+of Src repeats its last column or row. */
+
+static void ShrinkMip(const CanvasPixel *Src,
+                      int SrcWidth,
+                      int SrcHeight,
+                      CanvasPixel *Dst,
+                      int DstWidth,
+                      int FromX,
+                      int ToX,
+                      int FromY,
+                      int ToY) {
+
+  for (int Y=FromY;Y<ToY;Y++) {
+    const CanvasPixel *Top=Src+size_t(2*Y)*SrcWidth;
+    const CanvasPixel *Bottom=2*Y+1<SrcHeight ? Top+SrcWidth : Top;
+    CanvasPixel *Row=Dst+size_t(Y)*DstWidth;
+    for (int X=FromX;X<ToX;X++) {
+      int Left=2*X;
+      int Right=Left+1<SrcWidth ? Left+1 : Left;
+      uint32_t A=uint32_t(Top[Left]),B=uint32_t(Top[Right]);
+      uint32_t C=uint32_t(Bottom[Left]),D=uint32_t(Bottom[Right]);
+
+      /* Sum the even and the odd bytes in 16-bit lanes. */
+
+      uint32_t Even=(A&0xFF00FF)+(B&0xFF00FF)+(C&0xFF00FF)+(D&0xFF00FF)+0x20002;
+      uint32_t Odd=((A>>8)&0xFF00FF)+((B>>8)&0xFF00FF)+((C>>8)&0xFF00FF)+
+        ((D>>8)&0xFF00FF)+0x20002;
+      Row[X]=((Even>>2)&0xFF00FF)|(((Odd>>2)&0xFF00FF)<<8);
+    }
+  }
+}
+
+/* Frees the pyramid of canvas extension CE. */
+
+static void FreeMip(CanvasExtension *CE) {
+
+  for (int Level=0;Level<-MinZoom;Level++) {
+    FreeCanvasMemory(CE->Mip[Level]);
+    CE->Mip[Level]=0;
+  }
+  free(CE->MipStale);
+  CE->MipStale=0;
+}
+
+/* Marks the pyramid of canvas C stale over the canvas rectangle from
+(FromX,FromY) to (ToX,ToY), both inclusive. */
+
+static void StaleMip(Canvas *C,
+                     int FromX,
+                     int ToX,
+                     int FromY,
+                     int ToY) {
+
+  CanvasExtension *CE=CExt(C);
+  if (!CE->MipStale)
+    return;
+  if (FromX<0) FromX=0;
+  if (FromY<0) FromY=0;
+  if (ToX>=C->Width) ToX=C->Width-1;
+  if (ToY>=C->Height) ToY=C->Height-1;
+  for (int TY=FromY>>MipTileShift;TY<=ToY>>MipTileShift;TY++)
+    for (int TX=FromX>>MipTileShift;TX<=ToX>>MipTileShift;TX++)
+      CE->MipStale[TY*CE->MipColumns+TX]=(1<<-MinZoom)-1;
+}
+
+/* Brings mip tile (TX,TY) of level Level of the pyramid of canvas C up
+to date, along with the levels below it. */
+
+static void RefreshMip(Canvas *C,
+                       int Level,
+                       int TX,
+                       int TY) {
+
+  CanvasExtension *CE=CExt(C);
+  unsigned char *Stale=&CE->MipStale[TY*CE->MipColumns+TX];
+  int Bit=1<<(Level-1);
+  if (!(*Stale&Bit))
+    return;
+  const CanvasPixel *Src=C->Pixels;
+  if (Level>1) {
+    RefreshMip(C,Level-1,TX,TY);
+    Src=CE->Mip[Level-2];
+  }
+  int Width=MipSize(C->Width,Level);
+  int Height=MipSize(C->Height,Level);
+  int ToX=((TX+1)<<MipTileShift)>>Level;
+  int ToY=((TY+1)<<MipTileShift)>>Level;
+  ShrinkMip(Src,MipSize(C->Width,Level-1),MipSize(C->Height,Level-1),
+            CE->Mip[Level-1],Width,
+            (TX<<MipTileShift)>>Level,ToX<Width ? ToX : Width,
+            (TY<<MipTileShift)>>Level,ToY<Height ? ToY : Height);
+  *Stale&=~Bit;
+}
+
+/* Makes level Level of the pyramid of canvas C up to date over the
+canvas rectangle from (FromX,FromY) to (ToX,ToY), both inclusive and
+within the canvas. Returns 0 if there is not enough memory for the
+pyramid. */
+
+static int PrepareMip(Canvas *C,
+                      int Level,
+                      int FromX,
+                      int ToX,
+                      int FromY,
+                      int ToY) {
+
+  CanvasExtension *CE=CExt(C);
+  if (!CE->MipStale) {
+    CE->MipColumns=MipSize(C->Width,MipTileShift);
+    CE->MipRows=MipSize(C->Height,MipTileShift);
+    CE->MipStale=(unsigned char *)(calloc(size_t(CE->MipColumns)*CE->MipRows,1));
+    if (!CE->MipStale) {
+      fprintf(stderr,"Insufficient memory to shrink canvas view.\n");
+      return 0;
+    }
+  }
+  for (int i=1;i<=Level;i++)
+    if (!CE->Mip[i-1]) {
+      CE->Mip[i-1]=(CanvasPixel *)
+        (AllocCanvasMemory(size_t(MipSize(C->Width,i))*MipSize(C->Height,i)*
+                           sizeof(CanvasPixel)));
+      if (!CE->Mip[i-1]) {
+        fprintf(stderr,"Insufficient memory to shrink canvas view.\n");
+        return 0;
+      }
+      for (int j=0;j<CE->MipColumns*CE->MipRows;j++)
+        CE->MipStale[j]|=1<<(i-1);
+    }
+  for (int TY=FromY>>MipTileShift;TY<=ToY>>MipTileShift;TY++)
+    for (int TX=FromX>>MipTileShift;TX<=ToX>>MipTileShift;TX++)
+      RefreshMip(C,Level,TX,TY);
+  return 1;
+}
+
+/* Redraws the X image of canvas C from window coordinates (FromX,FromY)
+to (ToX,ToY), both inclusive and within the window. */
+
+static void RedrawView(Canvas *C,
+                       int FromX,
+                       int ToX,
+                       int FromY,
+                       int ToY) {
+
+  CanvasExtension *CE=CExt(C);
+  RowConverter Convert=ChooseRowConverter(CE);
+  int Count=ToX-FromX+1;
+
+  /* Window columns from EndX on, and rows from EndY on, lie beyond the
+     canvas. */
+
+  int EndX=ViewEnd(CE,C->Width,CE->OriginX,ToX+1);
+  int EndY=ViewEnd(CE,C->Height,CE->OriginY,ToY+1);
+  if (EndX<FromX)
+    EndX=FromX;
+
+  /* Magnified rows repeat the window row above them, unless the pixels
+     depend on their position on the screen. */
+
+  int Replicate=!TestImage && Convert!=&Row8Dithered;
+  int BytesPerPixel=CE->Image->bits_per_pixel/8;
+
+  /* Shrunk rows are read from the pyramid, which must first be brought
+     up to date under the window area. */
+
+  const CanvasPixel *Mip=0;
+  int MipWidth=0;
+  if (CE->Zoom<0 && EndX>FromX && EndY>FromY) {
+    int Level=-CE->Zoom;
+    int MipToX=CE->OriginX+(EndX<<Level)-1;
+    int MipToY=CE->OriginY+(EndY<<Level)-1;
+    if (PrepareMip(C,Level,CE->OriginX+(FromX<<Level),
+                   MipToX<C->Width ? MipToX : C->Width-1,
+                   CE->OriginY+(FromY<<Level),
+                   MipToY<C->Height ? MipToY : C->Height-1)) {
+      MipWidth=MipSize(C->Width,Level);
+      Mip=CE->Mip[Level-1]+(CE->OriginY>>Level)*size_t(MipWidth)+
+        (CE->OriginX>>Level);
+    } else
+      EndY=FromY;
+  }
+
+  for (int Y=FromY;Y<=ToY;Y++) {
+    if (Y>=EndY) {
+      (*Convert)(CE,CE->ViewBlank,FromX,Y,Count);
+      continue;
+    }
+    if (EndX==FromX)
+      ;
+    else if (CE->Zoom==0)
+      (*Convert)(CE,&PIXEL(C,CE->OriginX+FromX,CE->OriginY+Y),FromX,Y,
+                 EndX-FromX);
+    else if (CE->Zoom>0) {
+      if (Replicate && Y>FromY && (Y>>CE->Zoom)==((Y-1)>>CE->Zoom)) {
+        memcpy(ImageAddress(CE->Image,FromX,Y),
+               ImageAddress(CE->Image,FromX,Y-1),Count*BytesPerPixel);
+        continue;
+      }
+      const CanvasPixel *Src=&PIXEL(C,CE->OriginX,CE->OriginY+(Y>>CE->Zoom));
+      for (int X=FromX;X<EndX;X++)
+        CE->ViewRow[X-FromX]=Src[X>>CE->Zoom];
+      (*Convert)(CE,CE->ViewRow,FromX,Y,EndX-FromX);
+    } else
+      (*Convert)(CE,Mip+Y*size_t(MipWidth)+FromX,FromX,Y,EndX-FromX);
+    if (EndX<=ToX)
+      (*Convert)(CE,CE->ViewBlank,EndX,Y,ToX-EndX+1);
+  }
+
+  /* Merge the overlay into the image, one window pixel or magnified
+     block per overlay pixel. */
+
+  DamageRect B=CE->OverlayBounds;
+  if (B.FromX>B.ToX || !CanvasToView(C,&B) ||
+      B.FromX>ToX || B.ToX<FromX || B.FromY>ToY || B.ToY<FromY)
+    return;
+  int Size=CE->Zoom>0 ? 1<<CE->Zoom : 1;
+  CanvasPixel Color[1<<MaxZoom];
+  for (int i=0;i<Size;i++)
+    Color[i]=CE->OverlayColor;
+  int SpanX=ViewSpan(CE,CE->ViewWidth)+1;
+  int SpanY=ViewSpan(CE,CE->ViewHeight)+1;
+  for (int i=0;i<CE->OverlayCount;i++) {
+    int X=CE->OverlayX[i]-CE->OriginX;
+    int Y=CE->OverlayY[i]-CE->OriginY;
+    if (X<0 || Y<0 || X>SpanX || Y>SpanY)
+      continue;
+    X=CE->Zoom>=0 ? X<<CE->Zoom : X>>-CE->Zoom;
+    Y=CE->Zoom>=0 ? Y<<CE->Zoom : Y>>-CE->Zoom;
+    int BlockFromX=X>FromX ? X : FromX;
+    int BlockToX=X+Size-1<ToX ? X+Size-1 : ToX;
+    int BlockToY=Y+Size-1<ToY ? Y+Size-1 : ToY;
+    for (int BY=Y>FromY ? Y : FromY;BY<=BlockToY;BY++)
+      if (BlockFromX<=BlockToX)
+        (*Convert)(CE,Color,BlockFromX,BY,BlockToX-BlockFromX+1);
+  }
+}
+
+/* Clamps the origin of the view of canvas C so that the view does not
+reach past the right and bottom edges of the canvas when it need not,
+and aligns it with the pyramid when the view shrinks the canvas. */
+
+static void ClampView(Canvas *C) {
+
+  CanvasExtension *CE=CExt(C);
+  int MaxX=C->Width-ViewSpan(CE,CE->ViewWidth);
+  int MaxY=C->Height-ViewSpan(CE,CE->ViewHeight);
+  if (CE->OriginX>MaxX) CE->OriginX=MaxX;
+  if (CE->OriginY>MaxY) CE->OriginY=MaxY;
+  if (CE->OriginX<0) CE->OriginX=0;
+  if (CE->OriginY<0) CE->OriginY=0;
+  if (CE->Zoom<0) {
+    CE->OriginX&=~((1<<-CE->Zoom)-1);
+    CE->OriginY&=~((1<<-CE->Zoom)-1);
+  }
+}
+
+/* Stores in *Width and *Height the size of the window of canvas C: the
+size of the canvas, up to most of the screen. */
+
+static void FitWindow(Canvas *C,
+                      int *Width,
+                      int *Height) {
+
+  Screen *S=DefaultScreenOfDisplay(Disp);
+  int MaxWidth=WidthOfScreen(S)*7/8;
+  int MaxHeight=HeightOfScreen(S)*7/8;
+  *Width=C->Width<MaxWidth ? C->Width : MaxWidth;
+  *Height=C->Height<MaxHeight ? C->Height : MaxHeight;
+}
+
+/* Gives the window of canvas C a new X image of Width by Height pixels,
+and marks it to be redrawn. */
+
+static void SetViewSize(Canvas *C,
+                        int Width,
+                        int Height) {
+
+  CanvasExtension *CE=CExt(C);
+  if (Width<1) Width=1;
+  if (Height<1) Height=1;
+  if (CE->Image && Width==CE->ViewWidth && Height==CE->ViewHeight)
+    return;
+  if (CE->Image)
+    DestroyCanvasImage(CE);
+  CreateCanvasImage(CE,Width,Height);
+  CE->ViewRow=(CanvasPixel *)(realloc(CE->ViewRow,Width*sizeof(CanvasPixel)));
+  CE->ViewBlank=(CanvasPixel *)(realloc(CE->ViewBlank,Width*sizeof(CanvasPixel)));
+  if (!CE->ViewRow || !CE->ViewBlank) {
+    fprintf(stderr,"Not enough memory for canvas.\n");
+    exit(1);
+  }
+  for (int i=0;i<Width;i++)
+    CE->ViewBlank[i]=ViewBackground;
+  CE->ViewWidth=Width;
+  CE->ViewHeight=Height;
+  CE->ViewDirty=1;
+  ClampView(C);
+}
+
+/* DAMAGE ACCUMULATION. */
+
+/* Returns the number of pixels the bounding box of rectangles A and B
+has in excess of rectangle A. */
+
+static int DamageGrowth(const DamageRect *A,
+                        const DamageRect *B) {
+
+  int Width=(B->ToX>A->ToX ? B->ToX : A->ToX)-(B->FromX<A->FromX ? B->FromX : A->FromX)+1;
+  int Height=(B->ToY>A->ToY ? B->ToY : A->ToY)-(B->FromY<A->FromY ? B->FromY : A->FromY)+1;
+  return Width*Height-(A->ToX-A->FromX+1)*(A->ToY-A->FromY+1);
+}
+
+/* Enlarges rectangle A to the bounding box of rectangles A and B. */
+
+static void MergeDamage(DamageRect *A,
+                        const DamageRect *B) {
+
+  if (B->FromX<A->FromX) A->FromX=B->FromX;
+  if (B->ToX>A->ToX) A->ToX=B->ToX;
+  if (B->FromY<A->FromY) A->FromY=B->FromY;
+  if (B->ToY>A->ToY) A->ToY=B->ToY;
+}
+
+/* Adds rectangle R to the damaged region of canvas C. Overlapping and
+adjacent rectangles are merged into their bounding box, and so is the
+new rectangle with the one it grows the least when there is no room
+for another rectangle. */
+
+static void AddDamage(Canvas *C,
+                      const DamageRect *R) {
+
+  CanvasExtension *CE=CExt(C);
+  DamageRect New=*R;
+
+  for (int i=0;i<CE->DamageCount;) {
+    DamageRect *D=&CE->Damage[i];
+    if (New.FromX<=D->ToX+1 && D->FromX<=New.ToX+1 &&
+        New.FromY<=D->ToY+1 && D->FromY<=New.ToY+1) {
+      /* Absorb D and start over, as the merged rectangle may now
+         overlap rectangles it did not overlap before. */
+      MergeDamage(&New,D);
+      *D=CE->Damage[--CE->DamageCount];
+      i=0;
+    } else
+      i++;
+  }
+  if (CE->DamageCount==MaxDamage) {
+    int Best=0;
+    for (int i=1;i<MaxDamage;i++)
+      if (DamageGrowth(&CE->Damage[i],&New)<DamageGrowth(&CE->Damage[Best],&New))
+        Best=i;
+    MergeDamage(&New,&CE->Damage[Best]);
+    CE->Damage[Best]=CE->Damage[--CE->DamageCount];
+  }
+  CE->Damage[CE->DamageCount++]=New;
+}
+
+/* Converts and sends to the X server the damaged rectangles of canvas
+C. */
+
+static void PresentDamage(Canvas *C) {
+
+  CanvasExtension *CE=CExt(C);
+  int Put=0;
+  if (CE->ViewDirty) {
+    RedrawView(C,0,CE->ViewWidth-1,0,CE->ViewHeight-1);
+    PutCanvasImage(CE,0,0,CE->ViewWidth,CE->ViewHeight);
+    Put=1;
+  } else
+    for (int i=0;i<CE->DamageCount;i++) {
+      DamageRect R=CE->Damage[i];
+      if (!CanvasToView(C,&R))
+        continue;
+      RedrawView(C,R.FromX,R.ToX,R.FromY,R.ToY);
+      PutCanvasImage(CE,R.FromX,R.FromY,R.ToX-R.FromX+1,R.ToY-R.FromY+1);
+      Put=1;
+    }
+  CE->DamageCount=0;
+  CE->ViewDirty=0;
+
+  /* The X server reads shared memory images after XShmPutImage()
+     returns; wait for it before the image is modified again. Nothing
+     needs waiting for if no image was put. */
+
+  if (Put && CE->Shm.shmaddr)
+    XSync(Disp,False);
+}
+
+/* Presents the damage of all canvases accumulated during the last
+frame. */
+
+static void PresentFrame(XtPointer,
+                         XtIntervalId *) {
+
+  FrameTimer=0;
+  for (int i=0;AllCanvases[i].Callback;i++)
+    PresentDamage(&AllCanvases[i]);
+}
+
+/* Presents the damage of canvas C now, or at the next frame. */
+
+static void ScheduleDamage(Canvas *C) {
+
+  if (!FrameRate)
+    PresentDamage(C);
+  else if (!FrameTimer)
+    FrameTimer=XtAppAddTimeOut(AppContext,1000/FrameRate,
+                               XtTimerCallbackProc(PresentFrame),0);
+}
+
+/* Redraws the canvas rectangle from (FromX,FromY) to (ToX,ToY) of
+canvas C, whose pixels have not changed, now or at the next frame. */
+
+static void RedrawCanvas(Canvas *C,
+                         int FromX,
+                         int ToX,
+                         int FromY,
+                         int ToY) {
+
+  DamageRect R={FromX,ToX,FromY,ToY};
+  AddDamage(C,&R);
+  ScheduleDamage(C);
+}
+
+/* Zooms the view of canvas C to Zoom, keeping the canvas pixel under
+window coordinates (X,Y) in place. */
+
+static void ZoomView(Canvas *C,
+                     int X,
+                     int Y,
+                     int Zoom) {
+
+  CanvasExtension *CE=CExt(C);
+  if (Zoom<MinZoom) Zoom=MinZoom;
+  if (Zoom>MaxZoom) Zoom=MaxZoom;
+  int CX=CE->OriginX+(CE->Zoom>=0 ? FloorShift(X,CE->Zoom) : X*(1<<-CE->Zoom));
+  int CY=CE->OriginY+(CE->Zoom>=0 ? FloorShift(Y,CE->Zoom) : Y*(1<<-CE->Zoom));
+  SetCanvasView(C,Zoom,
+                CX-(Zoom>=0 ? FloorShift(X,Zoom) : X*(1<<-Zoom)),
+                CY-(Zoom>=0 ? FloorShift(Y,Zoom) : Y*(1<<-Zoom)));
+}
+
+/* Drags the view of canvas C along with the pointer, which has moved to
+window coordinates (X,Y). A magnified view moves by whole canvas
+pixels; the remainder of the motion is kept for the next drag. */
+
+static void PanView(Canvas *C,
+                    int X,
+                    int Y) {
+
+  CanvasExtension *CE=CExt(C);
+  int DX,DY;
+  if (CE->Zoom>=0) {
+    DX=FloorShift(X-CE->PanX,CE->Zoom);
+    DY=FloorShift(Y-CE->PanY,CE->Zoom);
+    CE->PanX+=DX<<CE->Zoom;
+    CE->PanY+=DY<<CE->Zoom;
+  } else {
+    DX=(X-CE->PanX)*(1<<-CE->Zoom);
+    DY=(Y-CE->PanY)*(1<<-CE->Zoom);
+    CE->PanX=X;
+    CE->PanY=Y;
+  }
+  if (DX || DY)
+    SetCanvasView(C,CE->Zoom,CE->OriginX-DX,CE->OriginY-DY);
 }
 
 static void AirbrushPuff(Canvas *C,
@@ -399,6 +1483,8 @@ static void DrawingPointerMotion(Widget,
   /* Retain brush location. */
 
   CanvasExtension *CE=CExt(C);
+  if (CE->Panning)
+    PanView(C,Event->xmotion.x,Event->xmotion.y);
   CE->BrushX=Event->xmotion.x;
   CE->BrushY=Event->xmotion.y;
   
@@ -418,6 +1504,18 @@ static void DrawingButtonPress(Widget,
     CE->BrushY=Event->y;
     CE->BrushState=Event->state|Button1Mask;
     AirbrushPuff(C,0);
+  } else if (Event->button==Button2) {
+    CanvasExtension *CE=CExt(C);
+    CE->Panning=1;
+    CE->PanX=Event->x;
+    CE->PanY=Event->y;
+  } else if (Event->button==Button4 || Event->button==Button5) {
+    CanvasExtension *CE=CExt(C);
+
+    /* The canvas pixel under the pointer stays in place, so the
+       callback is not run; with the button held it would paint. */
+
+    ZoomView(C,Event->x,Event->y,CE->Zoom+(Event->button==Button4 ? 1 : -1));
   }
 }
 
@@ -433,7 +1531,23 @@ static void DrawingButtonRelease(Widget,
     }
     CExt(C)->BrushState=0;
     (*(C->Callback))(Event->x,Event->y,0);
-  }
+  } else if (Event->button==Button2)
+    CExt(C)->Panning=0;
+}
+
+static void DrawingResize(Widget,
+                          Canvas *C,
+                          XmDrawingAreaCallbackStruct *) {
+
+  CanvasExtension *CE=CExt(C);
+  Dimension Width,Height;
+  XtVaGetValues(CE->Handle,
+                XmNwidth,&Width,
+                XmNheight,&Height,
+                NULL);
+  SetViewSize(C,Width,Height);
+  if (CE->ViewDirty)
+    ScheduleDamage(C);
 }
 
 static void DrawingCross(Widget,
@@ -480,6 +1594,7 @@ void LiftOff(int *argc,
   /* COMMAND-LINE ARGUMENTS. */
 
   int Use8Bit=0;
+  int NoShm=0;
   for (int i=1;i<*argc;i++) {
     if (!strcmp(argv[i],"-help")) {
       fprintf(stderr,"xsupport package options (defaults in parens):\n");
@@ -487,6 +1602,8 @@ void LiftOff(int *argc,
       fprintf(stderr,"-help: displays this screen (No).\n");
       fprintf(stderr,"-gamma: sets monitor gamma (8-bit mode only) (2.0).\n");
       fprintf(stderr,"-8bit: enforce 8-bit mode (No).\n");
+      fprintf(stderr,"-fps: canvas updates per second, 0 for immediate (60).\n");
+      fprintf(stderr,"-noshm: do not use shared memory images (No).\n");
       fprintf(stderr,"\n");
       fprintf(stderr,"And all the standard X command-line arguments.\n");
       fprintf(stderr,"\n");
@@ -504,6 +1621,20 @@ void LiftOff(int *argc,
       }
     } else if (!strcmp(argv[i],"-8bit"))
       Use8Bit=1;
+    else if (!strcmp(argv[i],"-noshm"))
+      NoShm=1;
+    else if (!strcmp(argv[i],"-fps")) {
+      if (++i==*argc) {
+        fprintf(stderr,
+                "-fps should precede the number of updates per second.\n");
+        break;
+      }
+      FrameRate=atoi(argv[i]);
+      if (FrameRate<0) {
+        fprintf(stderr,"Updates per second must not be negative.\n");
+        exit(1);
+      }
+    }
   }
 
 
@@ -680,6 +1811,7 @@ void LiftOff(int *argc,
   }
   for (i=0;Sliders[i].Callback;i++) {
     Sliders[i].Private=(SliderExtension *)(malloc(sizeof(SliderExtension)));
+    SExt(&Sliders[i])->Dragged=0;
     /* Create slider. */
 
     XmString Str=XmStringCreateSimple(Sliders[i].Name);
@@ -696,7 +1828,11 @@ void LiftOff(int *argc,
                                  NULL);
     XtAddCallback(SExt(&Sliders[i])->Handle,XmNvalueChangedCallback,
                   XtCallbackProc(SliderPrecallback),
-                  XtPointer(Sliders[i].Callback));
+                  XtPointer(&Sliders[i]));
+    if (Sliders[i].Live)
+      XtAddCallback(SExt(&Sliders[i])->Handle,XmNdragCallback,
+                    XtCallbackProc(SliderDragPrecallback),
+                    XtPointer(&Sliders[i]));
     XmStringFree(Str);
   }
 
@@ -726,6 +1862,8 @@ void LiftOff(int *argc,
     fprintf(stderr,"Display not supported.\n");
     exit(1);
   }
+  CanvasVisual=VInfo.visual;
+  UseShm=!NoShm && XShmQueryExtension(Disp);
 
   /* Create blank cursor. */
 
@@ -749,6 +1887,27 @@ void LiftOff(int *argc,
     CE->BrushState=0;
     CE->Timer=0;
     CE->Mask=ALL_COLORS;
+    CE->DamageCount=0;
+    CE->OverlayCount=0;
+    CE->OverlaySize=0;
+    CE->OverlayX=0;
+    CE->OverlayY=0;
+    CE->OverlayBounds.FromX=0;
+    CE->OverlayBounds.ToX=-1;
+    CE->Image=0;
+    CE->Zoom=0;
+    CE->OriginX=0;
+    CE->OriginY=0;
+    CE->ViewWidth=0;
+    CE->ViewHeight=0;
+    CE->ViewRow=0;
+    CE->ViewBlank=0;
+    for (int Level=0;Level<-MinZoom;Level++)
+      CE->Mip[Level]=0;
+    CE->MipStale=0;
+    CE->Panning=0;
+    int ViewWidth,ViewHeight;
+    FitWindow(&Canvases[i],&ViewWidth,&ViewHeight);
 
     /* Create colormap. */
 
@@ -762,8 +1921,8 @@ void LiftOff(int *argc,
                                   XmNdeleteResponse,XmDO_NOTHING,
                                   XmNiconPixmap,Icon,
                                   XmNiconName,"Canvas",
-                                  XmNwidth,Canvases[i].Width,
-                                  XmNheight,Canvases[i].Height,
+                                  XmNwidth,ViewWidth,
+                                  XmNheight,ViewHeight,
 #if 0
                                   XmNallowShellResize,False,
                                   XmNminWidth,Canvases[i].Width,
@@ -795,25 +1954,18 @@ void LiftOff(int *argc,
 
     /* Create canvas image. */
 
-    unsigned long *Image=
-      (unsigned long *)(malloc(Canvases[i].Width*Canvases[i].Height*
-                               sizeof(unsigned long)));
-    if (!Image) {
-      fprintf(stderr,"Not enough memory for canvas.\n");
-      exit(1);
-    }
-    CE->Image=
-      XCreateImage(Disp,VInfo.visual,BitPlanes,ZPixmap,0,(char *)(Image),
-                   Canvases[i].Width,Canvases[i].Height,32,0);
+    SetViewSize(&Canvases[i],ViewWidth,ViewHeight);
 
     /* Create canvas. */
 
     CE->Handle=XtVaCreateManagedWidget("",xmDrawingAreaWidgetClass,Top,
-                                       XmNwidth,Canvases[i].Width,
-                                       XmNheight,Canvases[i].Height,
+                                       XmNwidth,ViewWidth,
+                                       XmNheight,ViewHeight,
                                        NULL);
     XtAddCallback(CE->Handle,XmNexposeCallback,
                   XtCallbackProc(DrawingExpose),XtPointer(CE));
+    XtAddCallback(CE->Handle,XmNresizeCallback,
+                  XtCallbackProc(DrawingResize),XtPointer(&Canvases[i]));
     XtAddEventHandler(CE->Handle,PointerMotionMask,False,
                       XtEventHandler(DrawingPointerMotion),
                       XtPointer(&Canvases[i]));
@@ -843,8 +1995,8 @@ void LiftOff(int *argc,
 
     /* Display initial image. */
 
-    RedrawCanvasImage(&Canvases[i],
-                      0,Canvases[i].Width-1,0,Canvases[i].Height-1);
+    RedrawView(&Canvases[i],0,ViewWidth-1,0,ViewHeight-1);
+    CE->ViewDirty=0;
   }
 
 
@@ -856,6 +2008,8 @@ void LiftOff(int *argc,
 
   /* PASS CONTROL TO MOTIF. */
 
+  AllCanvases=Canvases;
+  AllSliders=Sliders;
   MainLoopStarted=1;
   XtAppMainLoop(AppContext);
 }
@@ -894,14 +2048,147 @@ void UpdateCanvas(Canvas *C,
     fprintf(stderr,"Cannot update canvas before LiftOff() is called.\n");
     return;
   }
+  StaleMip(C,FromX,ToX,FromY,ToY);
+  RedrawCanvas(C,FromX,ToX,FromY,ToY);
+}
+
+void SetCanvasView(Canvas *C,
+                   int Zoom,
+                   int OriginX,
+                   int OriginY) {
+
+  if (!MainLoopStarted) {
+    fprintf(stderr,"Cannot set canvas view before LiftOff() is called.\n");
+    return;
+  }
+  CanvasExtension *CE=CExt(C);
+  if (Zoom<MinZoom) Zoom=MinZoom;
+  if (Zoom>MaxZoom) Zoom=MaxZoom;
+  int OldZoom=CE->Zoom,OldX=CE->OriginX,OldY=CE->OriginY;
+  CE->Zoom=Zoom;
+  CE->OriginX=OriginX;
+  CE->OriginY=OriginY;
+  ClampView(C);
+  if (CE->Zoom==OldZoom && CE->OriginX==OldX && CE->OriginY==OldY)
+    return;
+  CE->ViewDirty=1;
+  ScheduleDamage(C);
+}
+
+int WindowToCanvas(Canvas *C,
+                   int WindowX,
+                   int WindowY,
+                   int *X,
+                   int *Y) {
+
+  if (!MainLoopStarted) {
+    *X=WindowX;
+    *Y=WindowY;
+    return WindowX>=0 && WindowX<C->Width && WindowY>=0 && WindowY<C->Height;
+  }
+  CanvasExtension *CE=CExt(C);
+  if (CE->Zoom>=0) {
+    *X=CE->OriginX+FloorShift(WindowX,CE->Zoom);
+    *Y=CE->OriginY+FloorShift(WindowY,CE->Zoom);
+  } else {
+    int Half=(1<<-CE->Zoom)/2;
+    *X=CE->OriginX+WindowX*(1<<-CE->Zoom)+Half;
+    *Y=CE->OriginY+WindowY*(1<<-CE->Zoom)+Half;
+  }
+  return WindowX>=0 && WindowX<CE->ViewWidth &&
+    WindowY>=0 && WindowY<CE->ViewHeight;
+}
+
+int ClipCanvasView(Canvas *C,
+                   int *FromX,
+                   int *ToX,
+                   int *FromY,
+                   int *ToY) {
+
+  if (MainLoopStarted) {
+    CanvasExtension *CE=CExt(C);
+    int EndX=CE->OriginX+(CE->Zoom>=0 ? (CE->ViewWidth-1)>>CE->Zoom :
+                          (CE->ViewWidth<<-CE->Zoom)-1);
+    int EndY=CE->OriginY+(CE->Zoom>=0 ? (CE->ViewHeight-1)>>CE->Zoom :
+                          (CE->ViewHeight<<-CE->Zoom)-1);
+    if (*FromX<CE->OriginX) *FromX=CE->OriginX;
+    if (*FromY<CE->OriginY) *FromY=CE->OriginY;
+    if (*ToX>EndX) *ToX=EndX;
+    if (*ToY>EndY) *ToY=EndY;
+  }
+  return ClipCanvasRect(C,FromX,ToX,FromY,ToY);
+}
+
+void SetCanvasOverlay(Canvas *C,
+                      int X,
+                      int Y,
+                      int Count,
+                      const int *OffsetX,
+                      const int *OffsetY,
+                      CanvasPixel Color) {
+
+  if (!MainLoopStarted) {
+    fprintf(stderr,"Cannot set canvas overlay before LiftOff() is called.\n");
+    return;
+  }
   CanvasExtension *CE=CExt(C);
-  RedrawCanvasImage(C,FromX,ToX,FromY,ToY);
-  XPutImage(Disp,XtWindow(CE->Handle),Gc,CE->Image,FromX,FromY,
-            FromX,FromY,ToX-FromX+1,ToY-FromY+1);
+  DamageRect Old=CE->OverlayBounds;
+
+  if (Count>CE->OverlaySize) {
+    int *NewX=(int *)(realloc(CE->OverlayX,Count*sizeof(int)));
+    if (NewX)
+      CE->OverlayX=NewX;
+    int *NewY=(int *)(realloc(CE->OverlayY,Count*sizeof(int)));
+    if (NewY)
+      CE->OverlayY=NewY;
+    if (!NewX || !NewY) {
+      fprintf(stderr,"Insufficient memory to allocate canvas overlay.\n");
+      Count=0;
+    } else
+      CE->OverlaySize=Count;
+  }
+
+  /* Keep only the pixels within the canvas, and their bounds. */
+
+  DamageRect *B=&CE->OverlayBounds;
+  B->FromX=C->Width;
+  B->ToX=-1;
+  B->FromY=C->Height;
+  B->ToY=-1;
+  CE->OverlayCount=0;
+  for (int i=0;i<Count;i++) {
+    int PX=X+OffsetX[i];
+    int PY=Y+OffsetY[i];
+    if (PX<0 || PX>=C->Width || PY<0 || PY>=C->Height)
+      continue;
+    CE->OverlayX[CE->OverlayCount]=PX;
+    CE->OverlayY[CE->OverlayCount]=PY;
+    CE->OverlayCount++;
+    if (PX<B->FromX) B->FromX=PX;
+    if (PX>B->ToX) B->ToX=PX;
+    if (PY<B->FromY) B->FromY=PY;
+    if (PY>B->ToY) B->ToY=PY;
+  }
+  CE->OverlayColor=Color;
+
+  /* Redraw the area the overlay left and the area it now covers. */
+
+  if (Old.FromX<=Old.ToX) {
+    if (Old.ToX>=C->Width) Old.ToX=C->Width-1;
+    if (Old.ToY>=C->Height) Old.ToY=C->Height-1;
+    if (Old.FromX<=Old.ToX && Old.FromY<=Old.ToY)
+      RedrawCanvas(C,Old.FromX,Old.ToX,Old.FromY,Old.ToY);
+  }
+  if (B->FromX<=B->ToX)
+    RedrawCanvas(C,B->FromX,B->ToX,B->FromY,B->ToY);
 }
 
 void Flush(void) {
 
+  if (FrameTimer) {
+    XtRemoveTimeOut(FrameTimer);
+    PresentFrame(0,0);
+  }
   XFlush(Disp);
 }
 
@@ -919,7 +2206,48 @@ void SetCanvasMode(Canvas *C,
     CE->GammaCorrect=GammaCorrect;
     SetColormap(CE);
   }
-  UpdateCanvas(C,0,C->Width-1,0,C->Height-1);
+  RedrawCanvas(C,0,C->Width-1,0,C->Height-1);
+}
+
+/* Makes canvas C, with extension CE, NewWidth by NewHeight pixels, unless
+it already has that size, with its window fitted to the new size and
+the view reset to 1:1. Pending damage and the overlay are dropped and
+the pyramid of the view is marked stale, since they refer to the old
+pixels. */
+
+static void SetCanvasSize(Canvas *C,
+                          CanvasExtension *CE,
+                          int NewWidth, int NewHeight) {
+
+  CE->DamageCount = 0;
+  CE->OverlayCount = 0;
+  CE->OverlayBounds.FromX = 0;
+  CE->OverlayBounds.ToX = -1;
+  if (NewWidth == C->Width && NewHeight == C->Height) {
+    StaleMip(C,0,C->Width-1,0,C->Height-1);
+    return;
+  }
+
+  FreeMip(CE);
+  C->Width = NewWidth;
+  C->Height = NewHeight;
+  CE->Zoom = 0;
+  CE->OriginX = 0;
+  CE->OriginY = 0;
+  CE->ViewDirty = 1;
+  int ViewWidth, ViewHeight;
+  FitWindow(C,&ViewWidth,&ViewHeight);
+  SetViewSize(C,ViewWidth,ViewHeight);
+  XtVaSetValues(CE->Handle,
+                XmNwidth,ViewWidth,
+                XmNheight,ViewHeight,
+                NULL);
+  XtVaSetValues(XtParent(CE->Handle),
+                XmNwidth,ViewWidth,
+                XmNheight,ViewHeight,
+                NULL);
+  XResizeWindow(XtDisplay(CE->Handle), XtWindow(XtParent(CE->Handle)), 
+                ViewWidth, ViewHeight);
 }
 
 void ResizeCanvas(Canvas *C,
@@ -929,38 +2257,31 @@ void ResizeCanvas(Canvas *C,
     return;
   }
   CanvasExtension *CE=CExt(C);
-  char * NewXImageBuffer = (char *) malloc(NewWidth * NewHeight * 
-                                           sizeof(unsigned long));
-  if (!NewXImageBuffer) {
-    fprintf(stderr,"Insufficient memory to allocate new canvas.\n");
-    return;
-  }
-  unsigned long * NewBuffer = (unsigned long *) 
-       malloc(NewWidth * NewHeight * sizeof(unsigned long));
+  CanvasPixel * NewBuffer = (CanvasPixel *) 
+       ReuseCanvasMemory(C->Pixels,
+                         size_t(NewWidth) * NewHeight * sizeof(CanvasPixel));
   if (!NewBuffer) {
     fprintf(stderr,"Insufficient memory to allocate new canvas.\n");
     return;
   }
   
-  free(CE->Image->data);
-  CE->Image->data = NewXImageBuffer;
-  CE->Image->bytes_per_line = NewWidth * CE->Image->bits_per_pixel / 8;
-  CE->Image->width = NewWidth;
-  CE->Image->height = NewHeight;
-  C->Width = NewWidth;
-  C->Height = NewHeight;
-
+  SetCanvasSize(C,CE,NewWidth,NewHeight);
   C->Pixels = NewBuffer;
-  XtVaSetValues(CE->Handle,
-                XmNwidth,NewWidth,
-                XmNheight,NewHeight,
-                NULL);
-  XtVaSetValues(XtParent(CE->Handle),
-                XmNwidth,NewWidth,
-                XmNheight,NewHeight,
-                NULL);
-  XResizeWindow(XtDisplay(CE->Handle), XtWindow(XtParent(CE->Handle)), 
-                NewWidth, NewHeight);
+}
+
+void AdoptCanvasPixels(Canvas *C,
+                       CanvasPixel *Pixels,
+                       int NewWidth, int NewHeight) {
+
+  if (Pixels != C->Pixels)
+    FreeCanvasMemory(C->Pixels);
+  if (MainLoopStarted)
+    SetCanvasSize(C,CExt(C),NewWidth,NewHeight);
+  else {
+    C->Width = NewWidth;
+    C->Height = NewHeight;
+  }
+  C->Pixels = Pixels;
 }
 
 void SetSensitive(char * container, int index, int grayed) {
@@ -13,6 +13,8 @@
 
 #include "X11/Intrinsic.h"
 
+#include <stdint.h>
+
 
 /* USER INTERFACE DATA STRUCTURES. */
 
@@ -105,7 +107,15 @@ being dragged). The single float argument passed to the callback
 contains the slider value exactly as displayed on the screen (i.e. the
 adjustment for significant digits and decimals has been taken care
 of). Hence, in the previous example, the callback argument would be a
-float in the range 0 to 1 (both inclusive). */
+float in the range 0 to 1 (both inclusive).
+
+When Live is non-zero, Callback is also called while the slider is
+being dragged, so that the program can show the effect of the new
+value right away. Dragging produces far more values than can be shown,
+so these calls are made at most once per frame (see the -fps
+command-line argument of LiftOff()), with the latest value; the values
+in between are dropped. The value at which the slider is released is
+always passed to Callback. */
 
 typedef struct {
   void *Private; /* FOR PRIVATE USE - DO NOT TOUCH! */
@@ -116,16 +126,34 @@ typedef struct {
   int InitialValue;
   short Decimals;
   void (*Callback)(float);	
+  int Live; /* boolean */
 } Slider;
 
+/* A canvas pixel.
+
+The red, green, and blue components of a canvas pixel are packed in a
+single 32-bit unsigned integer, each component taking up 8 bits. Older
+versions of xsupport kept every pixel in an unsigned long, which takes
+twice the memory on 64-bit systems for the same 24 bits of color. That
+layout is still available as a compatibility build: compile xsupport
+and your program with XSUPPORT_LONG_PIXELS defined (i.e. "make
+LONG_PIXELS=1"). Always declare pixel variables and buffers as
+CanvasPixel so that your code works with both layouts. */
+
+#ifdef XSUPPORT_LONG_PIXELS
+typedef unsigned long CanvasPixel;
+#else
+typedef uint32_t CanvasPixel;
+#endif
+
 /* A canvas.
 
 A canvas is a rectangular area holding the contents of an image. Width
 and Height set respectively the horizontal and vertical dimensions of
 the canvas. Pixels is the array of pixel values. Conceptually, it is a
-2-D array of total size Width*Height, with one element of unsigned
-long type per image pixel. The red, green, and blue components of a
-pixel are encoded within this single long, each component taking up 8
+2-D array of total size Width*Height, with one CanvasPixel element per
+image pixel. The red, green, and blue components of a pixel are
+encoded within this single element, each component taking up 8
 bits.  We do not ask you to access the elements of the Pixels array
 directly, since it is easy to get confused both when trying to index
 the array and also when trying to extract the primary color components
@@ -153,13 +181,16 @@ window. Hence, Callback is called when:
  within the canvas.
 
 Callback's first two arguments contain the location of the mouse in
-canvas coordinates; these are defined so that (0,0) is the top left
-corner of the canvas window. As inferred from above, Callback may be
-called with its first two arguments specifying a coordinate outside
-the active canvas area, i.e. outside the range 0 to Width-1
-horizontally or 0 to Height-1 vertically. In particular, you can
-assume that this will always happen when Callback is called as a
-result of the user moving the mouse out of the canvas.
+window coordinates; these are defined so that (0,0) is the top left
+corner of the canvas window. They are the canvas coordinates of the
+pixel under the mouse as long as the window shows the canvas 1:1 from
+its top left corner; in general, WindowToCanvas() converts them (see
+"Canvas views" below). As inferred from above, Callback may be called
+with its first two arguments specifying a coordinate outside the
+window. In particular, you can assume that this will always happen
+when Callback is called as a result of the user moving the mouse out
+of the canvas. Callback is also called when the view of the canvas
+changes under the mouse.
 
 The third argument passed to Callback is set to the status of the left
 mouse button and the modifier keys. This status changes over time, and
@@ -191,7 +222,7 @@ typedef struct {
   int Width;
   int Height;
   int PuffInterval;
-  unsigned long *Pixels;
+  CanvasPixel *Pixels;
   void (*Callback)(int, int, unsigned int);
   int DisableHardwareCursor; /* boolean */
 } Canvas;
@@ -222,7 +253,15 @@ canvas C (where C is a pointer to a canvas structure). (0,0) are the
 coordinates of the top left corner of the canvas, while the bottom
 right corner is located at (C->Width-1,C->Height-1). */
 
-#define PIXEL(C,X,Y) ((C)->Pixels[(Y)*(C)->Width+(X)])
+#define PIXEL(C,X,Y) ((C)->Pixels[(size_t)(Y)*(C)->Width+(X)])
+
+/* The pixels of a canvas are stored row by row, so the pixels
+(X,Y),(X+1,Y),...,(X+N-1,Y) occupy consecutive elements of the Pixels
+array. The following macro retrieves the address of the first pixel of
+row Y of the canvas C. CANVAS_ROW(C,Y)[X] is the same pixel as
+PIXEL(C,X,Y). */
+
+#define CANVAS_ROW(C,Y) (&(C)->Pixels[(size_t)(Y)*(C)->Width])
 
 
 /* FUNCTION DECLARATIONS. */
@@ -261,6 +300,18 @@ arguments:
  this automatic detection scheme, and enforces 8-bit colormap display
  on all screens.
 
+ -fps <n>: sets the number of times per second canvas updates are
+ presented on the screen to n. The default value is 60. A value of 0
+ presents every update as soon as UpdateCanvas() is called. See
+ UpdateCanvas(). The same rate limits the calls of live sliders while
+ they are dragged (see Slider).
+
+ -noshm: disables shared memory images. When the X server runs on
+ the same machine and supports the MIT-SHM extension, xsupport keeps
+ the images of the canvases in memory shared with the server, which
+ makes canvas updates much cheaper. This switch forces the regular
+ (socket) transfer of the pixels.
+
  -gamma <g>: sets the monitor gamma to g. This value is used only when
  the display is in 8-bit mode. The default value is 2.0. When you
  force 8-bit mode on a 24-bit screen, using the "-8bit" switch, set
@@ -302,13 +353,18 @@ void SetSlider(Slider *S,
 
 /* File-canvas interface.
 
-LoadCanvas() reads the contents of the file named FileName into the
-canvas C. The Pixels array of C is NOT deallocated by LoadCanvas().
-However, LoadCanvas() does allocate a new Pixels array (using
-malloc()), big enough to fit the image read.
+LoadCanvas() reads the binary (P6) PPM file named FileName into the
+canvas C, rescaling samples of any other maximum value to 8 bits. The
+Pixels array of C is NOT deallocated by LoadCanvas(). However,
+LoadCanvas() does allocate a new Pixels array (using
+AllocCanvasPixels()), big enough to fit the image read. C is left
+unchanged if the file is not a complete PPM image.
 
 SaveCanvas() saves the canvas C into the file named FileName. The
-Pixels array of C is not modified by SaveCanvas().
+Pixels array of C is not modified by SaveCanvas(). The image is first
+written to a temporary file in the same directory, which replaces
+FileName only when it is complete and synced to disk; if the save
+fails, an existing file named FileName is left intact.
 
 Both routines return 1 if and only if they complete successfully. */
 
@@ -318,6 +374,99 @@ int LoadCanvas(char *Filename,
 int SaveCanvas(char *Filename,
 	       Canvas *C);
 
+/* Row spans.
+
+A row span is a run of Length consecutive pixels of one canvas row,
+starting at Pixels. Walking a rectangle of a canvas one row span at a
+time visits the pixels in the order they are stored in memory, which
+is much faster than walking it column by column.
+
+ClipCanvasRect() clips the rectangle with its top left corner located
+at (*FromX,*FromY), and its bottom right corner at (*ToX,*ToY), to the
+bounds of the canvas C. It returns the number of rows of the clipped
+rectangle, or 0 if the rectangle lies entirely outside the canvas.
+
+CanvasRowSpan() returns the row span of the pixels (FromX,Y) to
+(ToX,Y) of the canvas C, both inclusive. It is your responsibility to
+guarantee that the span lies within the canvas bounds, e.g. by
+clipping the rectangle first. */
+
+typedef struct {
+  CanvasPixel *Pixels;
+  int Length;
+} CanvasSpan;
+
+int ClipCanvasRect(Canvas *C,
+                   int *FromX,
+                   int *ToX,
+                   int *FromY,
+                   int *ToY);
+
+CanvasSpan CanvasRowSpan(Canvas *C,
+                         int FromX,
+                         int ToX,
+                         int Y);
+
+/* Canvas memory.
+
+AllocCanvasMemory() allocates Bytes bytes for canvas pixels or images,
+aligned to 64 bytes so that vector loops may use aligned accesses. A
+block of 2 megabytes or more is aligned to 2 megabytes instead and, on
+Linux, advised to be backed by transparent huge pages. It returns NULL
+if there is not enough memory. AllocCanvasPixels() allocates an array
+of Width by Height canvas pixels the same way.
+
+ReuseCanvasMemory() returns a block of at least Bytes bytes in place
+of the block at Data, whose contents are NOT preserved. The block at
+Data is returned again if it is big enough and not much bigger than
+needed; otherwise it is freed and a new block is allocated. NULL is
+returned, and Data is left alone, if there is not enough memory.
+
+FreeCanvasMemory() frees a block allocated by these routines. It also
+accepts NULL, and arrays allocated with malloc(), such as the Pixels
+arrays of the canvases passed to LiftOff(), which it simply frees.
+
+LiveCanvasMemory() returns the total size of the blocks allocated by
+these routines and not yet freed, including the images xsupport keeps
+for the canvases on the screen, unless they live in shared memory.
+
+SetCanvasStore() places every block of Threshold bytes or more that is
+allocated from then on in a file of its own, created in the directory
+named Directory and mapped into memory, instead of RAM; NULL turns the
+store off. The operating system then keeps in RAM only the pages of a
+large canvas that are in use, reads the others back when they are
+touched and writes changed pages back to the file when it needs the
+memory. The files are removed as soon as they are created, so they
+vanish when their blocks are freed or the program exits. A block that
+cannot be mapped is allocated in RAM.
+
+PrefetchCanvasRect() asks the operating system to start reading the
+pages of the rectangle with its top left corner at (FromX,FromY) and
+its bottom right corner at (ToX,ToY) of the canvas C, if its pixels
+are in the store, so that they are in memory by the time they are
+needed. The rectangle is clipped to the canvas. */
+
+void *AllocCanvasMemory(size_t Bytes);
+
+CanvasPixel *AllocCanvasPixels(int Width,
+			       int Height);
+
+void *ReuseCanvasMemory(void *Data,
+			size_t Bytes);
+
+void FreeCanvasMemory(void *Data);
+
+size_t LiveCanvasMemory(void);
+
+void SetCanvasStore(const char *Directory,
+		    size_t Threshold);
+
+void PrefetchCanvasRect(Canvas *C,
+			int FromX,
+			int ToX,
+			int FromY,
+			int ToY);
+
 /* Canvas redrawing.
 
 Draws on the screen a portion of the canvas C. In particular, it draws
@@ -326,6 +475,14 @@ bottom right corner at (ToX,ToY). It is your responsibility to
 guarantee that FromX, FromY, ToX, and ToY are all set to values within
 the canvas bounds.
 
+UpdateCanvas() does not draw right away. It adds the rectangle to the
+damaged region of the canvas, merging it with the rectangles it
+overlaps, and xsupport presents the damaged regions of all canvases
+once per frame (see the -fps command-line argument of LiftOff()). The
+pixels are read from the Pixels array when the frame is presented, so
+many small updates of the same area within a frame cost a single
+redraw. Flush() presents the pending damage immediately.
+
 If you call UpdateCanvas() for just a few pixels on the screen, then
 these updated pixels may not show up on the screen right away. This is
 a side effect of the X window system bufferring scheme. Moving the
@@ -348,6 +505,89 @@ void UpdateCanvas(Canvas *C,
 
 void Flush(void);
 
+/* Canvas overlay.
+
+SetCanvasOverlay() shows Count pixels of the color Color on top of the
+canvas C, at (X+OffsetX[i],Y+OffsetY[i]) for i from 0 to Count-1. The
+overlay is merged into the image of the canvas only when the image is
+presented on the screen; the Pixels array is never modified. This is
+meant for software cursors: moving the cursor does not require saving
+and restoring the pixels under it, and the program may paint under
+the cursor without removing it first.
+
+Overlay pixels outside the canvas are not shown. xsupport keeps a copy
+of the pixel coordinates, so the offset arrays may be changed or freed
+after the call, and it updates the parts of the canvas covered by the
+old and by the new overlay itself. A canvas has at most one overlay;
+each call replaces the previous one, and a Count of 0 removes it.
+
+This routine should be called after LiftOff() has been executed. */
+
+void SetCanvasOverlay(Canvas *C,
+		      int X,
+		      int Y,
+		      int Count,
+		      const int *OffsetX,
+		      const int *OffsetY,
+		      CanvasPixel Color);
+
+/* Canvas views.
+
+The window of a canvas shows the canvas through a view, which the user
+controls with the mouse: the wheel zooms in and out around the
+pointer, and dragging with the middle button pans the view. A view
+magnifies the canvas 2^Zoom times, replicating its pixels, or shrinks
+it 2^-Zoom times if Zoom is negative, averaging the blocks of pixels
+it shrinks; Zoom ranges from -4 to 4. The window is as big as the
+canvas, up to most of the screen, and may be resized by the user;
+only the pixels in the window are ever redrawn.
+
+A shrunk view is drawn from a pyramid of copies of the canvas, each
+half the size of the one below it, which takes up to a third of the
+memory of the canvas once the user zooms out. The pyramid is built as
+the view needs it and brought up to date only where UpdateCanvas()
+reports a change, so panning a shrunk view of a large canvas does not
+read the whole canvas again. Always call UpdateCanvas() after changing
+the Pixels array, even outside the window.
+
+SetCanvasView() sets the zoom of the view of canvas C to Zoom and puts
+the canvas pixel (OriginX,OriginY) at the top left corner of the
+window. The origin is adjusted so that the view does not go past the
+right and bottom edges of the canvas, when the canvas is big enough
+to fill the window; the origin of a shrunk view is also rounded down
+to a multiple of 2^-Zoom. Loading a canvas of a different size, e.g. with
+ResizeCanvas(), resets the view to 1:1 at (0,0).
+
+WindowToCanvas() converts the window coordinates (WindowX,WindowY), as
+passed to the Callback of canvas C, to the canvas coordinates (*X,*Y)
+of the pixel under them. It returns 1 if the window coordinates lie
+within the window. When the view is shrunk, the center of the block of
+pixels under the window pixel is returned.
+
+ClipCanvasView() clips the rectangle (*FromX,*FromY)-(*ToX,*ToY) of
+canvas C, both corners inclusive, to the part of the canvas shown in
+its window, and returns the number of rows left, like ClipCanvasRect().
+Before LiftOff() it clips to the bounds of the canvas only.
+
+SetCanvasView() should be called after LiftOff() has been executed. */
+
+void SetCanvasView(Canvas *C,
+		   int Zoom,
+		   int OriginX,
+		   int OriginY);
+
+int WindowToCanvas(Canvas *C,
+		   int WindowX,
+		   int WindowY,
+		   int *X,
+		   int *Y);
+
+int ClipCanvasView(Canvas *C,
+		   int *FromX,
+		   int *ToX,
+		   int *FromY,
+		   int *ToY);
+
 /* Canvas mode setting.
 
 Sets the image reproduction mode of canvas C to Mode. A canvas is
@@ -387,11 +627,28 @@ void SetCanvasMode(Canvas *C,
 /* ResizeCanvas 
 
 changes the size of the canvas and amount of memory allocated for it.
+The window of the canvas is resized to fit, and its view is reset.
+The contents of the Pixels array are undefined afterwards; the array
+itself is reused if it is about the right size, and freed otherwise.
 */
 
 void ResizeCanvas(Canvas *C,
 		  int NewWidth, int NewHeight);
 
+/* AdoptCanvasPixels 
+
+makes the canvas C display the NewWidth by NewHeight pixels of the
+array Pixels, allocated with AllocCanvasPixels() or malloc(), such as
+the array filled by LoadCanvas(). Nothing is copied: the canvas takes
+ownership of Pixels and frees its previous array with
+FreeCanvasMemory(). The window of the canvas follows its new size.
+Call UpdateCanvas() once the pixels are to be shown. This routine may
+be called before LiftOff(). */
+
+void AdoptCanvasPixels(Canvas *C,
+		       CanvasPixel *Pixels,
+		       int NewWidth, int NewHeight);
+
 
 /* Change the sensitivity of a control at the given index so
    it is grayed (insensitive) or not, depending on the boolean "grayed".